@@ -0,0 +1,160 @@
+#include "code_cache.hpp"
+#include "error.hpp"
+#include "units.hpp"
+#include <algorithm>
+#include <cstring>
+
+static const std::size_t MIN_BUCKET_COUNT = 64;
+static const std::size_t BYTES_PER_BUCKET = 4 * KiB; // ~ a small compiled script
+
+struct code_cache::entry {
+  entry *chain;
+  entry *newer;
+  entry *older;
+  std::uint64_t hash;
+  std::size_t path_size;
+  std::size_t source_size;
+  std::size_t bytecode_size;
+
+  // followed by path, source and bytecode
+  char *path() { return reinterpret_cast<char *>(this + 1); }
+  char *source() { return path() + path_size; }
+  std::uint8_t *bytecode() { return reinterpret_cast<std::uint8_t *>(source() + source_size); }
+};
+
+static std::uint64_t hash_of(const ruby_source &source);
+
+code_cache::code_cache(std::size_t capacity)
+    : newest_(nullptr), oldest_(nullptr), hits_(0), misses_(0) {
+  pool_ = me_memory_pool_new(capacity);
+  bucket_count_ = std::max(MIN_BUCKET_COUNT, capacity / BYTES_PER_BUCKET);
+  buckets_ = static_cast<entry **>(me_memory_pool_malloc(pool_, bucket_count_ * sizeof(entry *)));
+  if (buckets_ == nullptr) {
+    leave(status_code::bad_capacity);
+  }
+  std::memset(buckets_, 0, bucket_count_ * sizeof(entry *));
+}
+
+code_cache::~code_cache() {
+  me_memory_pool_destroy(pool_);
+}
+
+struct RProc *code_cache::generate_code(me_mruby_engine &engine, const ruby_source &source) {
+  if (source.compiled) {
+    return engine.generate_code(source);
+  }
+
+  auto hash = hash_of(source);
+  auto cached = find(hash, source);
+  if (cached != nullptr) {
+    hits_++;
+    unlink(cached);
+    push_newest(cached);
+    return engine.read_instruction_sequence(cached->bytecode());
+  }
+
+  misses_++;
+  auto proc = engine.generate_code(source);
+  insert(hash, source, engine.dump_instruction_sequence(proc));
+  return proc;
+}
+
+std::uint64_t code_cache::hits() const {
+  return hits_;
+}
+
+std::uint64_t code_cache::misses() const {
+  return misses_;
+}
+
+code_cache::entry *code_cache::find(std::uint64_t hash, const ruby_source &source) {
+  for (auto e = buckets_[hash % bucket_count_]; e != nullptr; e = e->chain) {
+    if (e->hash == hash
+        && e->path_size == source.path.size()
+        && e->source_size == source.source.size()
+        && std::memcmp(e->path(), source.path.data(), e->path_size) == 0
+        && std::memcmp(e->source(), source.source.data(), e->source_size) == 0) {
+      return e;
+    }
+  }
+  return nullptr;
+}
+
+void code_cache::insert(std::uint64_t hash, const ruby_source &source, const std::vector<std::uint8_t> &bytecode) {
+  auto size = sizeof(entry) + source.path.size() + source.source.size() + bytecode.size();
+  void *block;
+  while ((block = me_memory_pool_malloc(pool_, size)) == nullptr) {
+    if (oldest_ == nullptr) {
+      return; // doesn't fit, even on its own
+    }
+    evict(oldest_);
+  }
+
+  auto e = static_cast<entry *>(block);
+  e->hash = hash;
+  e->path_size = source.path.size();
+  e->source_size = source.source.size();
+  e->bytecode_size = bytecode.size();
+  std::memcpy(e->path(), source.path.data(), e->path_size);
+  std::memcpy(e->source(), source.source.data(), e->source_size);
+  std::memcpy(e->bytecode(), bytecode.data(), e->bytecode_size);
+
+  auto &bucket = buckets_[hash % bucket_count_];
+  e->chain = bucket;
+  bucket = e;
+  push_newest(e);
+}
+
+void code_cache::evict(entry *victim) {
+  for (auto link = &buckets_[victim->hash % bucket_count_]; *link != nullptr; link = &(*link)->chain) {
+    if (*link == victim) {
+      *link = victim->chain;
+      break;
+    }
+  }
+  unlink(victim);
+  me_memory_pool_free(pool_, victim);
+}
+
+void code_cache::unlink(entry *e) {
+  if (e->newer != nullptr) {
+    e->newer->older = e->older;
+  } else {
+    newest_ = e->older;
+  }
+  if (e->older != nullptr) {
+    e->older->newer = e->newer;
+  } else {
+    oldest_ = e->newer;
+  }
+}
+
+void code_cache::push_newest(entry *e) {
+  e->newer = nullptr;
+  e->older = newest_;
+  if (newest_ != nullptr) {
+    newest_->newer = e;
+  }
+  newest_ = e;
+  if (oldest_ == nullptr) {
+    oldest_ = e;
+  }
+}
+
+// HELPERS
+
+std::uint64_t hash_of(const ruby_source &source) {
+  // FNV-1a; a collision only costs a full comparison
+  std::uint64_t hash = 14695981039346656037ULL;
+  auto mix = [&hash](const std::string &bytes) {
+    for (auto byte : bytes) {
+      hash ^= static_cast<std::uint8_t>(byte);
+      hash *= 1099511628211ULL;
+    }
+  };
+  mix(source.path);
+  hash ^= 0xff; // separator, so that ("ab", "c") and ("a", "bc") differ
+  hash *= 1099511628211ULL;
+  mix(source.source);
+  return hash;
+}
@@ -0,0 +1,41 @@
+#ifndef ENTERPRISE_SCRIPT_SERVICE_CODE_CACHE_HPP
+#define ENTERPRISE_SCRIPT_SERVICE_CODE_CACHE_HPP
+
+#include "memory_pool.hpp"
+#include "mruby_engine.hpp"
+#include <cstdint>
+#include <vector>
+
+// Least recently used cache of compiled sources, keyed by path and source.
+// Entries are kept as instruction sequences in a memory pool of their own, so
+// they survive engine resets; the least recently used ones are evicted when
+// that pool is full.
+class code_cache {
+public:
+  explicit code_cache(std::size_t capacity);
+  ~code_cache();
+
+  struct RProc *generate_code(me_mruby_engine &engine, const ruby_source &source);
+
+  std::uint64_t hits() const;
+  std::uint64_t misses() const;
+
+private:
+  struct entry;
+
+  entry *find(std::uint64_t hash, const ruby_source &source);
+  void insert(std::uint64_t hash, const ruby_source &source, const std::vector<std::uint8_t> &bytecode);
+  void evict(entry *victim);
+  void unlink(entry *e);
+  void push_newest(entry *e);
+
+  me_memory_pool *pool_;
+  entry **buckets_;
+  std::size_t bucket_count_;
+  entry *newest_;
+  entry *oldest_;
+  std::uint64_t hits_;
+  std::uint64_t misses_;
+};
+
+#endif
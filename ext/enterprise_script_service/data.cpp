@@ -2,29 +2,173 @@
 #include "error.hpp"
 #include "mruby_engine.hpp"
 #include "script_runner.hpp"
+#include "vmstats.hpp"
 #include <mruby/array.h>
 #include <mruby/hash.h>
 #include <mruby/string.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <algorithm>
+#include <cstring>
 
 
 // GENERIC DATA BIT
 
+static std::vector<output_stream *> streams;
+
+static void write_fully(const int fd, struct iovec *iov, int count);
+
+output_stream::output_stream(const int fd, std::size_t capacity)
+    : fd(fd), buffer_(capacity > 0 ? new char[capacity] : nullptr), capacity_(capacity), size_(0),
+      queued_count_(0), queued_size_(0), mapping_(nullptr), mapping_capacity_(0), mapped_(0) {
+  streams.push_back(this);
+}
+
+output_stream::~output_stream() {
+  finish();
+  streams.erase(std::remove(streams.begin(), streams.end(), this), streams.end());
+}
+
 output_stream &output_stream::write(const char *buffer, std::size_t size) {
-  while(size > 0) {
-    ssize_t written = ::write(fd, buffer, size);
-    if (written == -1) {
-      if (errno == EINTR) continue;
-      leave(status_code::io_failure);
+  if (mapping_ != nullptr) {
+    if (size <= mapping_capacity_ - mapped_) {
+      std::memcpy(mapping_ + mapped_, buffer, size);
+      mapped_ += size;
+      return *this;
     }
-    buffer += written;
-    size -= written;
+    unmap();
   }
 
+  if (size < capacity_ / 4) {
+    if (size_ + size > capacity_) {
+      flush();
+    }
+    std::memcpy(buffer_.get() + size_, buffer, size);
+    size_ += size;
+  } else {
+    write_through(buffer, size);
+  }
+
+  return *this;
+}
+
+output_stream &output_stream::write_referenced(const char *buffer, std::size_t size) {
+  if (mapping_ != nullptr || capacity_ == 0 || size < capacity_ / 4) {
+    return write(buffer, size);
+  }
+
+  if (size_ > queued_size_) {
+    queued_[queued_count_++] = iovec{buffer_.get() + queued_size_, size_ - queued_size_};
+    queued_size_ = size_;
+  }
+  queued_[queued_count_++] = iovec{const_cast<char *>(buffer), size};
+  if (queued_count_ >= MAX_QUEUED - 1) {
+    flush();
+  }
   return *this;
 }
 
-output_stream::output_stream(const int fd) : fd(fd) {}
+void output_stream::flush_references() {
+  if (queued_count_ > 0) {
+    flush();
+  }
+}
+
+void output_stream::flush() {
+  if (mapping_ != nullptr) {
+    return; // already where the client reads it, once told how much there is
+  }
+  write_through(nullptr, 0);
+}
+
+void output_stream::finish() {
+  if (mapping_ != nullptr) {
+    unmap();
+  }
+  flush();
+}
+
+void output_stream::map_to(char *mapping, std::size_t size) {
+  mapping_ = mapping;
+  mapping_capacity_ = size;
+  mapped_ = 0;
+}
+
+void output_stream::unmap() {
+  msgpack::sbuffer record;
+  msgpack::packer<msgpack::sbuffer> packer{record};
+  packer.pack_array(2);
+  packer.pack(symbol{"mapped"});
+  packer.pack_uint64(mapped_);
+
+  mapping_ = nullptr;
+  write(record.data(), record.size());
+}
+
+void output_stream::write_through(const char *buffer, std::size_t size) {
+  // along with whatever is queued, in a single writev
+  queued_[queued_count_++] = iovec{buffer_.get() + queued_size_, size_ - queued_size_};
+  queued_[queued_count_++] = iovec{const_cast<char *>(buffer), size};
+  auto count = queued_count_;
+  size_ = 0; // leave() flushes again should this fail
+  queued_size_ = 0;
+  queued_count_ = 0;
+  write_fully(fd, queued_, count);
+}
+
+void symbol_table::pack(out_packer &packer, std::uint32_t key, const char *name, std::uint32_t length) {
+  auto found = ids_.find(key);
+  if (found == ids_.end()) {
+    ids_.emplace(key, static_cast<std::uint32_t>(ids_.size()));
+    packer.pack_ext(length, SYMBOL_DEFINITION_EXT_CODE);
+    packer.pack_ext_body(name, length);
+    return;
+  }
+
+  auto id = found->second;
+  std::uint32_t width = id <= UINT8_MAX ? 1 : id <= UINT16_MAX ? 2 : 4;
+  char body[4];
+  for (std::uint32_t i = 0; i < width; ++i) {
+    body[i] = static_cast<char>(id >> (8 * (width - 1 - i)));
+  }
+  packer.pack_ext(width, SYMBOL_REFERENCE_EXT_CODE);
+  packer.pack_ext_body(body, width);
+}
+
+void flush_output_streams() noexcept {
+  for (auto stream : streams) {
+    stream->finish();
+  }
+}
+
+void write_fully(const int fd, struct iovec *iov, int count) {
+  for (;;) {
+    while (count > 0 && iov->iov_len == 0) {
+      ++iov;
+      --count;
+    }
+    if (count == 0) {
+      return;
+    }
+
+    ssize_t written = count == 1
+      ? ::write(fd, iov->iov_base, iov->iov_len)
+      : ::writev(fd, iov, count);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      leave(status_code::io_failure);
+    }
+    while (count > 0 && static_cast<std::size_t>(written) >= iov->iov_len) {
+      written -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+      iov->iov_len -= written;
+    }
+  }
+}
 
 
 static void check_depth(int current_depth);
@@ -41,17 +185,128 @@ void data_writer::emit_measurement(std::string key, int64_t value) noexcept {
   packer.pack_int64(value);
 }
 
+void data_writer::emit_exit(int64_t code) noexcept {
+  packer.pack_array(2);
+  packer.pack(symbol{"exit"});
+  packer.pack_int64(code);
+}
+
+void data_writer::emit_item(uint64_t index) noexcept {
+  packer.pack_array(2);
+  packer.pack(symbol{"item"});
+  packer.pack_uint64(index);
+}
+
+void data_writer::emit_compiled(const std::string &path, const std::vector<std::uint8_t> &bytecode) noexcept {
+  packer.pack_array(2);
+  packer.pack(symbol{"compiled"});
+  packer.pack_array(2);
+  packer.pack(path);
+  packer.pack_bin((uint32_t) bytecode.size());
+  packer.pack_bin_body(reinterpret_cast<const char *>(bytecode.data()), (uint32_t) bytecode.size());
+}
+
+void data_writer::flush() noexcept {
+  packer.stream().flush();
+}
+
 // HELPERS
 
 static void emit_ruby_as_msgpack_rec(
     me_mruby_engine &engine,
     mrb_value ruby_value,
     out_packer &packer,
+    symbol_table *symbols,
     int depth);
+static const char *unemittable(me_mruby_engine &engine, mrb_value ruby_value, int depth);
+
+// Copies msgpack the way decoding and emitting it would have: BIN becomes
+// STR and FLOAT32 becomes FLOAT64, the rest is as it was.
+class repacker : public msgpack::v2::null_visitor {
+public:
+  repacker(out_packer &packer) : packer_(packer) {}
+
+  bool visit_nil() {
+    packer_.pack_nil();
+    return true;
+  }
+
+  bool visit_boolean(bool value) {
+    if (value) {
+      packer_.pack_true();
+    } else {
+      packer_.pack_false();
+    }
+    return true;
+  }
+
+  bool visit_positive_integer(std::uint64_t value) {
+    packer_.pack_uint64(value);
+    return true;
+  }
+
+  bool visit_negative_integer(std::int64_t value) {
+    packer_.pack_int64(value);
+    return true;
+  }
+
+  bool visit_float32(float value) {
+    return visit_float64(value);
+  }
+
+  bool visit_float64(double value) {
+    packer_.pack_double(value);
+    return true;
+  }
+
+  bool visit_str(const char *data, std::uint32_t size) {
+    // the payload outlives the output
+    packer_.pack_str(size);
+    packer_.stream().write_referenced(data, size);
+    return true;
+  }
+
+  bool visit_bin(const char *data, std::uint32_t size) {
+    return visit_str(data, size);
+  }
+
+  bool visit_ext(const char *data, std::uint32_t size) {
+    // `data` starts with the ext type
+    packer_.pack_ext(size - 1, static_cast<std::int8_t>(data[0]));
+    packer_.pack_ext_body(data + 1, size - 1);
+    return true;
+  }
+
+  bool start_array(std::uint32_t size) {
+    packer_.pack_array(size);
+    return true;
+  }
+
+  bool start_map(std::uint32_t size) {
+    packer_.pack_map(size);
+    return true;
+  }
 
+private:
+  out_packer &packer_;
+};
+static const char *emit_chunk(me_mruby_engine *engine, mrb_value value, void *context);
+static void emit_final_stat(me_mruby_engine *engine, void *context);
 
-mruby_data_writer::mruby_data_writer(data_writer &writer, me_mruby_engine &engine, std::uint64_t in)
-    : writer(writer), engine(engine), in(in) { }
+
+mruby_data_writer::mruby_data_writer(
+  data_writer &writer,
+  me_mruby_engine &engine,
+  std::uint64_t in,
+  const code_cache *cache,
+  bool tabulate_symbols,
+  bool dedup_strings)
+    : writer(writer), engine(engine), in(in), cache(cache), tabulate_symbols(tabulate_symbols),
+      dedup_strings(dedup_strings) {
+  engine.emit = ::emit_chunk;
+  engine.emit_context = this;
+  engine.wrap_up = ::emit_final_stat;
+}
 
 void mruby_data_writer::emit_output() {
   mrb_value output, stdout;
@@ -61,18 +316,34 @@ void mruby_data_writer::emit_output() {
   writer.packer.pack(symbol{"output"});
   writer.packer.pack_map(2);
   writer.packer.pack(symbol{"extracted"});
-  emit_ruby_as_msgpack_rec(engine, output, writer.packer, 0);
+  symbol_table symbols;
+  emit_ruby_as_msgpack_rec(engine, output, writer.packer, tabulate_symbols ? &symbols : nullptr, 0);
   writer.packer.pack(symbol{"stdout"});
   if (mrb_type(stdout) == MRB_TT_STRING) {
-    emit_ruby_as_msgpack_rec(engine, stdout, writer.packer, 0);
+    emit_ruby_as_msgpack_rec(engine, stdout, writer.packer, nullptr, 0);
   } else {
     writer.packer.pack_str((uint32_t) INVALID_STDOUT_MESSAGE.size());
     writer.packer.pack_str_body(INVALID_STDOUT_MESSAGE.data(), (uint32_t) INVALID_STDOUT_MESSAGE.size());
   }
 }
 
+const char *mruby_data_writer::emit_chunk(mrb_value value) {
+  // checked first: once packing has started, there's no backing out
+  auto error = unemittable(engine, value, 0);
+  if (error != nullptr) {
+    return error;
+  }
+
+  writer.packer.pack_array(2);
+  writer.packer.pack(symbol{"chunk"});
+  symbol_table symbols;
+  emit_ruby_as_msgpack_rec(engine, value, writer.packer, tabulate_symbols ? &symbols : nullptr, 0);
+  writer.packer.stream().flush_references(); // eval goes on
+  return nullptr;
+}
+
 void mruby_data_writer::emit_stat() {
-  std::uint64_t instructions = engine.instruction_count;
+  std::uint64_t instructions = engine.instruction_count();
   std::uint64_t total = engine.instruction_total;
   std::uint64_t execution_time_us = engine.execution_time_us;
   struct meminfo mem_info = me_memory_pool_info(engine.allocator);
@@ -80,7 +351,7 @@ void mruby_data_writer::emit_stat() {
 
   writer.packer.pack_array(2);
   writer.packer.pack(symbol{"stat"});
-  writer.packer.pack_map(5);
+  writer.packer.pack_map(9 + (cache ? 2 : 0) + (dedup_strings ? 1 : 0));
   writer.packer.pack(symbol{"instructions"});
   writer.packer.pack_int64(instructions);
   writer.packer.pack(symbol{"total_instructions"});
@@ -91,15 +362,45 @@ void mruby_data_writer::emit_stat() {
   writer.packer.pack_uint64(in);
   writer.packer.pack(symbol{"execution_time_us"});
   writer.packer.pack_uint64(execution_time_us);
+  writer.packer.pack(symbol{"gc_cycles"});
+  writer.packer.pack_uint64(engine.gc_cycles);
+  writer.packer.pack(symbol{"gc_time_us"});
+  writer.packer.pack_uint64(engine.gc_time_ns / 1000);
+  writer.packer.pack(symbol{"live_objects"});
+  writer.packer.pack_uint64(engine.state->gc.live);
+  writer.packer.pack(symbol{"peak_live_objects"});
+  writer.packer.pack_uint64(engine.peak_live_objects);
+  if (cache) {
+    writer.packer.pack(symbol{"cache_hits"});
+    writer.packer.pack_uint64(cache->hits());
+    writer.packer.pack(symbol{"cache_misses"});
+    writer.packer.pack_uint64(cache->misses());
+  }
+  if (dedup_strings) {
+    writer.packer.pack(symbol{"dedup_bytes"});
+    writer.packer.pack_uint64(engine.deduplicated_bytes);
+  }
 }
 
 mruby_data_writer::~mruby_data_writer() {
+  engine.emit = nullptr;
+  engine.emit_context = nullptr;
+  engine.wrap_up = nullptr;
   emit_stat();
+#ifdef ME_ENABLE_VMSTATS
+  engine.vmstats->emit(engine.state, writer.packer);
+#endif
+  writer.packer.stream().flush_references();
 }
 
 // HELPERS
 
-void emit_ruby_as_msgpack_rec(me_mruby_engine &engine, mrb_value ruby_value, out_packer &packer, int depth) {
+void emit_ruby_as_msgpack_rec(
+    me_mruby_engine &engine,
+    mrb_value ruby_value,
+    out_packer &packer,
+    symbol_table *symbols,
+    int depth) {
   check_depth(depth);
 
   if (mrb_nil_p(ruby_value)) {
@@ -126,8 +427,9 @@ void emit_ruby_as_msgpack_rec(me_mruby_engine &engine, mrb_value ruby_value, out
       if (length > UINT32_MAX) {
         throw fatal_error(status_code::overflow);
       }
+      // no ruby code runs until the writer calls flush_references
       packer.pack_str((uint32_t) length);
-      packer.pack_str_body(RSTRING_PTR(ruby_value), (uint32_t) length);
+      packer.stream().write_referenced(RSTRING_PTR(ruby_value), length);
       return;
     }
     case MRB_TT_SYMBOL: {
@@ -137,6 +439,10 @@ void emit_ruby_as_msgpack_rec(me_mruby_engine &engine, mrb_value ruby_value, out
       if (name == nullptr || length <= 0) {
         throw fatal_error(status_code::bad_symbol);
       }
+      if (symbols != nullptr) {
+        symbols->pack(packer, mrb_symbol(ruby_value), name, static_cast<std::uint32_t>(length));
+        return;
+      }
       packer.pack(symbol{name});
       return;
     }
@@ -148,7 +454,7 @@ void emit_ruby_as_msgpack_rec(me_mruby_engine &engine, mrb_value ruby_value, out
       packer.pack_array((uint32_t) f);
       for (auto i = mrb_int{0}; i < f; ++i) {
         auto element = RARRAY_PTR(ruby_value)[i];
-        emit_ruby_as_msgpack_rec(engine, element, packer, depth + 1);
+        emit_ruby_as_msgpack_rec(engine, element, packer, symbols, depth + 1);
       }
       return;
     }
@@ -167,19 +473,114 @@ void emit_ruby_as_msgpack_rec(me_mruby_engine &engine, mrb_value ruby_value, out
             continue;
           }
 
-          emit_ruby_as_msgpack_rec(engine, kh_key(kh, i), packer, depth + 1);
-          emit_ruby_as_msgpack_rec(engine, kh_value(kh, i).v, packer, depth + 1);
+          emit_ruby_as_msgpack_rec(engine, kh_key(kh, i), packer, symbols, depth + 1);
+          emit_ruby_as_msgpack_rec(engine, kh_value(kh, i).v, packer, symbols, depth + 1);
         }
       } else {
         packer.pack_map(0);
       }
       return;
     }
+    case MRB_TT_DATA: {
+      auto materialized = mrb_nil_value();
+      byte_range bytes;
+      if (lazy_input_p(engine, ruby_value, materialized, bytes)) {
+        if (mrb_nil_p(materialized)) {
+          // still as it was read, no need to decode it
+          repacker repack{packer};
+          std::size_t offset = 0;
+          msgpack::v2::parse(reinterpret_cast<const char *>(bytes.data), bytes.size(), offset, repack);
+        } else {
+          emit_ruby_as_msgpack_rec(engine, materialized, packer, symbols, depth);
+        }
+        return;
+      }
+      throw fatal_error(status_code::unknown_type);
+    }
     default:
       throw fatal_error(status_code::unknown_type);
   }
 }
 
+const char *unemittable(me_mruby_engine &engine, mrb_value ruby_value, int depth) {
+  // mirrors the failures of emit_ruby_as_msgpack_rec
+  if (depth > 32) {
+    return "structure too deep";
+  }
+  if (mrb_nil_p(ruby_value)) {
+    return nullptr;
+  }
+
+  switch (mrb_type(ruby_value)) {
+    case MRB_TT_FALSE:
+    case MRB_TT_TRUE:
+    case MRB_TT_FIXNUM:
+    case MRB_TT_FLOAT:
+      return nullptr;
+    case MRB_TT_STRING:
+      return RSTRING_LEN(ruby_value) > UINT32_MAX ? "string too long" : nullptr;
+    case MRB_TT_SYMBOL: {
+      auto length = mrb_int{0};
+      auto name = mrb_sym2name_len(engine.state, mrb_symbol(ruby_value), &length);
+      return name == nullptr || length <= 0 ? "bad symbol" : nullptr;
+    }
+    case MRB_TT_ARRAY: {
+      auto f = RARRAY_LEN(ruby_value);
+      if (f > UINT32_MAX) {
+        return "array too long";
+      }
+      for (auto i = mrb_int{0}; i < f; ++i) {
+        auto error = unemittable(engine, RARRAY_PTR(ruby_value)[i], depth + 1);
+        if (error != nullptr) {
+          return error;
+        }
+      }
+      return nullptr;
+    }
+    case MRB_TT_HASH: {
+      struct kh_ht *kh = RHASH_TBL(ruby_value);
+      if (kh == nullptr) {
+        return nullptr;
+      }
+      if (size_t{kh_size(kh)} > UINT32_MAX) {
+        return "hash too large";
+      }
+      for (int i = kh_begin(kh), f = kh_end(kh); i < f; ++i) {
+        if (!kh_exist(kh, i)) {
+          continue;
+        }
+        auto error = unemittable(engine, kh_key(kh, i), depth + 1);
+        if (error == nullptr) {
+          error = unemittable(engine, kh_value(kh, i).v, depth + 1);
+        }
+        if (error != nullptr) {
+          return error;
+        }
+      }
+      return nullptr;
+    }
+    case MRB_TT_DATA: {
+      auto materialized = mrb_nil_value();
+      byte_range bytes;
+      if (lazy_input_p(engine, ruby_value, materialized, bytes)) {
+        return mrb_nil_p(materialized) ? nullptr : unemittable(engine, materialized, depth);
+      }
+      return "unsupported type";
+    }
+    default:
+      return "unsupported type";
+  }
+}
+
+const char *emit_chunk(me_mruby_engine *, mrb_value value, void *context) {
+  return static_cast<mruby_data_writer *>(context)->emit_chunk(value);
+}
+
+void emit_final_stat(me_mruby_engine *, void *context) {
+  // leaving flushes it
+  static_cast<mruby_data_writer *>(context)->emit_stat();
+}
+
 void check_depth(int current_depth) {
   if (current_depth > 32) {
     throw fatal_error(status_code::structure_too_deep);
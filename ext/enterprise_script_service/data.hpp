@@ -2,9 +2,17 @@
 #define ENTERPRISE_SCRIPT_SERVICE_DATA_HPP
 
 #include <msgpack.hpp>
+#include <sys/uio.h>
+#include <memory>
+#include <unordered_map>
 
 
 static const int SYMBOL_EXT_CODE = 0x00;
+// The symbol table extension: within a message, the first occurrence of a
+// symbol is a definition, assigning it the next id from 0, and later ones are
+// references to that id, as a big-endian unsigned integer of 1, 2 or 4 bytes.
+static const int SYMBOL_DEFINITION_EXT_CODE = 0x01;
+static const int SYMBOL_REFERENCE_EXT_CODE = 0x02;
 
 class symbol {
   std::string name_;
@@ -31,20 +39,75 @@ namespace msgpack {
   }
 }
 
+// Writes through unless given a buffer capacity. Buffered streams only write
+// once full, when flushed, or when the process leaves; fragments too large
+// to be worth copying are written along with the buffer.
 struct output_stream {
-  output_stream(const int fd);
+  output_stream(const int fd, std::size_t capacity = 0);
+  output_stream(const output_stream &) = delete;
+  ~output_stream();
   output_stream &write(const char *, std::size_t);
+  // Like write, except that large fragments are queued as they are, to be
+  // written along with the buffer; they must stay unchanged until then.
+  output_stream &write_referenced(const char *, std::size_t);
+  // Writes out the fragments queued by write_referenced, if any.
+  void flush_references();
+  void flush();
+  // Flushes, ending the mapping if any: for when nothing more is written.
+  void finish();
+  // Copies writes into shared memory instead, until it is full or finished.
+  // Then a [:mapped, size] record goes to `fd`, telling how much of the
+  // mapping precedes whatever follows it there.
+  void map_to(char *mapping, std::size_t size);
 
   const int fd;
+
+private:
+  static const int MAX_QUEUED = 128;
+
+  void write_through(const char *, std::size_t);
+  void unmap();
+
+  std::unique_ptr<char[]> buffer_;
+  std::size_t capacity_;
+  std::size_t size_;
+  struct iovec queued_[MAX_QUEUED + 2]; // bits of the buffer and fragments, in order
+  int queued_count_;
+  std::size_t queued_size_; // of the buffer, up to the last queued fragment
+  char *mapping_;
+  std::size_t mapping_capacity_;
+  std::size_t mapped_;
+};
+
+// Finishes every output stream, see leave().
+void flush_output_streams() noexcept;
+
+class out_packer : public msgpack::packer<output_stream> {
+public:
+  out_packer(output_stream &stream) : msgpack::packer<output_stream>(stream), stream_(stream) { }
+  output_stream &stream() { return stream_; }
+
+private:
+  output_stream &stream_;
 };
 
+// The symbols of one message, keyed by anything unique to each.
+class symbol_table {
+public:
+  void pack(out_packer &packer, std::uint32_t key, const char *name, std::uint32_t length);
 
-using out_packer = msgpack::packer<output_stream>;
+private:
+  std::unordered_map<std::uint32_t, std::uint32_t> ids_;
+};
 
 class data_writer {
 public:
   data_writer(out_packer &packer);
   void emit_measurement(std::string key, int64_t value) noexcept;
+  void emit_exit(int64_t code) noexcept;
+  void emit_item(uint64_t index) noexcept;
+  void emit_compiled(const std::string &path, const std::vector<std::uint8_t> &bytecode) noexcept;
+  void flush() noexcept;
 
   out_packer &packer;
 };
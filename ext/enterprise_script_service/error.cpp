@@ -2,11 +2,21 @@
 #include "error.hpp"
 #include <unistd.h>
 
+static bool throwing_on_leave = false;
+
+static void throw_on_leave(status_code sc);
+
+void leave_by_throwing(bool throwing) {
+  throwing_on_leave = throwing;
+}
+
 #ifdef __linux__
 
 #include <sys/syscall.h>
 
 void leave(status_code sc) {
+  throw_on_leave(sc);
+  flush_output_streams();
   for (;;) {
     syscall(SYS_exit, static_cast<long>(sc));
   }
@@ -17,6 +27,8 @@ void leave(status_code sc) {
 #include <cstdlib>
 
 void leave(status_code sc) {
+  throw_on_leave(sc);
+  flush_output_streams();
   std::exit(static_cast<int>(sc));
 }
 
@@ -97,3 +109,12 @@ fatal_error::fatal_error(status_code err) : err(err) {}
 status_code fatal_error::get_err_code() const {
   return err;
 }
+
+// HELPERS
+
+void throw_on_leave(status_code sc) {
+  // nothing can be written after an io_failure: there's no carrying on
+  if (throwing_on_leave && sc != status_code::io_failure) {
+    throw fatal_error(sc);
+  }
+}
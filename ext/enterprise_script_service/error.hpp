@@ -28,9 +28,15 @@ enum struct status_code {
   type_error,
   bad_instruction_sequence,
   bad_seccomp_filter,
+  fork_failure,
+  time_quota_reached,
+  bad_options,
 };
 
 void leave(status_code) __attribute__((noreturn));
+// While set, leave() throws a fatal_error rather than exiting, for the caller
+// to carry on from wherever it catches it; an io_failure still exits.
+void leave_by_throwing(bool throwing);
 
 class fatal_error : public std::exception {
 public:
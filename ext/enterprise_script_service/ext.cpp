@@ -4,21 +4,43 @@
 #include "error.hpp"
 #include "script_runner.hpp"
 #include "options.hpp"
+#include "profiler.hpp"
+#include "zygote.hpp"
+#include "shared_memory.hpp"
 #include <sys/time.h>
+#include <fcntl.h>
 #include <iostream>
+#include <memory>
 #include <unistd.h>
 
-static me_mruby_engine *init_engine(const timer &t, me_memory_pool *allocator, const std::uint64_t instruction_quota);
+static const std::size_t OUTPUT_BUFFER_SIZE = 64 * KiB;
+static const int INPUT_PIPE_SIZE = 1 * MiB;
+static const std::size_t PROFILE_ENTRIES = 20;
+
+static me_mruby_engine *init_engine(const timer &t, me_memory_pool *allocator, options &opts);
 static me_memory_pool *init_mem_pool(const timer &t, size_t capacity);
-static void read_data(script_data &script, const timer &t);
+static me_mruby_engine *fork_server(const timer &t, options &opts);
+static void work(timer &t, data_writer &writer, options &opts) __attribute__((noreturn));
+static status_code serve(timer &t, data_writer &writer, options &opts, me_mruby_engine &engine, code_cache *cache, script_data &script);
+static void read_data(script_data &script, const timer &t, bool input_required, const int input_fd);
+static bool read_data_start(script_data &script, const timer &t, bool input_required);
+static void read_data_rest(script_data &script, const timer &t, bool input_required, const std::function<void()> &sources_read);
 static void sandbox(const timer &t);
 
 int main(int argc, char *argv[]) {
   auto code = status_code::ok;
   try {
-    reserve_memory();
+    options opts;
+    opts.read_from(argc, argv);
+    if (!opts.valid()) {
+      leave(status_code::bad_options);
+    }
+
+    // unless mapped, payloads are partly read once sandboxed
+    auto mapped = !opts.fork_server() && !opts.worker() && opts.input_fd() != -1;
+    reserve_memory(!mapped);
 
-    output_stream stream{STDOUT_FILENO};
+    output_stream stream{STDOUT_FILENO, OUTPUT_BUFFER_SIZE};
     out_packer packer{stream};
     data_writer writer(packer);
     auto script = new script_data();
@@ -27,18 +49,67 @@ int main(int argc, char *argv[]) {
       writer.emit_measurement(name, timed);
     });
 
-    read_data(*script, t);
+    if (opts.worker()) {
+      work(t, writer, opts);
+    }
 
-    options opts;
-    opts.read_from(argc, argv);
+    me_mruby_engine *engine;
+    if (opts.fork_server()) {
+      engine = fork_server(t, opts);
+    } else {
+      if (opts.output_fd() != -1) {
+        std::size_t size;
+        stream.map_to(map_output(opts.output_fd(), size), size);
+      }
+      if (mapped) {
+        read_data(*script, t, !opts.compile(), opts.input_fd());
+      }
+      me_memory_pool *allocator = init_mem_pool(t, opts.memory_quota());
+      engine = init_engine(t, allocator, opts);
+    }
 
-    me_memory_pool *allocator = init_mem_pool(t, opts.memory_quota());
-    me_mruby_engine *engine = init_engine(t, allocator, opts.instruction_quota());
-
-    sandbox(t);
+    profiler *profile = nullptr;
+    if (opts.profile()) {
+      // the engine also emits it when leaving over a quota
+      profile = new profiler(writer, PROFILE_ENTRIES);
+      me_mruby_engine_profile(engine, profile);
+    }
+    if (opts.time_quota() > 0) {
+      // setting the timer is off limits once sandboxed
+      me_mruby_engine_limit_time(engine, opts.time_quota());
+    }
+    auto rest = !mapped && read_data_start(*script, t, !opts.compile());
+#ifdef F_SETPIPE_SZ
+    // room for the client to keep writing while the sources compile
+    fcntl(STDIN_FILENO, F_SETPIPE_SZ, INPUT_PIPE_SIZE);
+#endif
 
+    // The heap can't grow once sandboxed: all that's left to read by then is
+    // an input that comes last, as the sources compile.
+    auto sandboxed = false;
     script_runner runner(*engine, t);
-    runner.run(*script, writer, opts.instruction_quota_start());
+    if (rest) {
+      std::function<void()> prepare;
+      if (!opts.compile()) {
+        prepare = [&runner, script, &t, &sandboxed]() {
+          sandbox(t);
+          sandboxed = true;
+          runner.prepare(*script);
+        };
+      }
+      read_data_rest(*script, t, !opts.compile(), prepare);
+    }
+    if (!sandboxed) {
+      sandbox(t);
+    }
+    if (opts.compile()) {
+      runner.compile(*script, writer);
+    } else {
+      runner.run(*script, writer, opts.instruction_quota_start());
+    }
+    if (profile != nullptr) {
+      profile->emit();
+    }
   } catch(fatal_error e) {
     code = e.get_err_code();
   }
@@ -54,9 +125,28 @@ void sandbox(const timer &t) {
     sandbox();
 }
 
-void read_data(script_data &script, const timer &t) {
+void read_data(script_data &script, const timer &t, bool input_required, const int input_fd) {
     auto timing = t.measure("in");
-    script.read_from(STDIN_FILENO);
+    std::size_t size;
+    auto payload = map_input(input_fd, size);
+    script.read_from(payload, size, input_required);
+}
+
+bool read_data_start(script_data &script, const timer &t, bool input_required) {
+    // all of a payload's memory is allocated before sandboxing
+    auto timing = t.measure("in");
+    return script.read_start_from(STDIN_FILENO, input_required);
+}
+
+void read_data_rest(script_data &script, const timer &t, bool input_required, const std::function<void()> &sources_read) {
+    // "in" stops while sources_read runs; waiting on the input after it is
+    // timed as "in_input"
+    std::unique_ptr<timer::scope> timing{new timer::scope("in", t)};
+    script.read_rest_from(STDIN_FILENO, input_required, [&timing, &t, &sources_read]() {
+      timing.reset();
+      sources_read();
+      timing.reset(new timer::scope("in_input", t));
+    });
 }
 
 me_memory_pool *init_mem_pool(const timer &t, size_t capacity) {
@@ -68,11 +158,66 @@ me_memory_pool *init_mem_pool(const timer &t, size_t capacity) {
   return allocator;
 }
 
-me_mruby_engine *init_engine(const timer &t, me_memory_pool *allocator, const std::uint64_t instruction_quota) {
+me_mruby_engine *init_engine(const timer &t, me_memory_pool *allocator, options &opts) {
+  me_gc_options gc{opts.gc_interval_ratio(), opts.gc_step_ratio(), opts.gc_generational()};
   me_mruby_engine *engine;
   {
     auto timing = t.measure("init");
-    engine = me_mruby_engine_new(allocator, instruction_quota);
+    engine = me_mruby_engine_new(allocator, opts.instruction_quota(), &gc);
   }
   return engine;
 }
+
+me_mruby_engine *fork_server(const timer &t, options &opts) {
+  // nobody is listening on stdout until a request comes in
+  timer quiet([](const std::string, const int64_t) {});
+  me_memory_pool *allocator = init_mem_pool(quiet, opts.memory_quota());
+  me_mruby_engine *engine = init_engine(quiet, allocator, opts);
+
+  fork_per_request(STDIN_FILENO, t);
+  return engine;
+}
+
+void work(timer &t, data_writer &writer, options &opts) {
+  me_memory_pool *allocator = init_mem_pool(t, opts.memory_quota());
+  me_mruby_engine *engine = init_engine(t, allocator, opts);
+  me_memory_pool_snapshot *pristine = me_memory_pool_snapshot_new(allocator);
+  code_cache *cache = opts.code_cache_size() > 0 ? new code_cache(opts.code_cache_size()) : nullptr;
+  sandbox(t);
+
+  for (auto fresh = true; ; fresh = false) {
+    script_data script;
+    {
+      auto timing = t.measure("in");
+      if (!script.read_framed_from(STDIN_FILENO)) {
+        leave(status_code::ok);
+      }
+    }
+
+    if (!fresh) {
+      // the engine lives in the pool: it comes back along with it
+      auto timing = t.measure("restore");
+      allocator = me_memory_pool_restore(allocator, pristine);
+    }
+
+    auto code = serve(t, writer, opts, *engine, cache, script);
+    writer.emit_exit(static_cast<int64_t>(code));
+    writer.flush();
+  }
+}
+
+status_code serve(timer &t, data_writer &writer, options &opts, me_mruby_engine &engine, code_cache *cache, script_data &script) {
+  // Leaving, e.g. over a quota, throws instead of exiting, unwinding the
+  // request from wherever it was, mruby frames included: its engine is left
+  // as is, and the pool restored before the next one.
+  auto code = status_code::ok;
+  leave_by_throwing(true);
+  try {
+    script_runner runner(engine, t, cache);
+    runner.run(script, writer, opts.instruction_quota_start());
+  } catch (fatal_error e) {
+    code = e.get_err_code();
+  }
+  leave_by_throwing(false);
+  return code;
+}
@@ -16,6 +16,12 @@ module Flags
       end
     end
 
+    # Unwinding tables for mruby's C, so that leave() can throw through the
+    # engine's frames up to the worker.
+    def exception_flags
+      %w(-fexceptions)
+    end
+
     def library_paths
       # Necessary because of https://github.com/mruby/mruby/issues/4537
       %w(/usr/local/lib /usr/lib)
@@ -33,7 +39,16 @@ module Flags
     end
 
     def defines
-      io_safe_defines + %w(MRB_DISABLE_STDIO)
+      io_safe_defines + %w(MRB_DISABLE_STDIO) + instrumentation_defines
+    end
+
+    # Builds tallying opcodes and send sites into `vmstats` messages.
+    def instrumentation_defines
+      if ENV['MRUBY_ENGINE_ENABLE_VMSTATS']
+        %w(ME_ENABLE_VMSTATS)
+      else
+        []
+      end
     end
   end
 end
@@ -4,17 +4,49 @@
 #include "units.hpp"
 #include <sys/mman.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 
 struct me_memory_pool {
   mspace mspace_;
   uint8_t *start;
   std::size_t capacity;
+  uint8_t *high_water; // end of the furthest block ever handed out
 };
 
 #define CAPACITY_MIN ((std::size_t)(256 * KiB))
 #define CAPACITY_MAX ((std::size_t)(256 * MiB))
 #define ALLOC_MAX ((std::size_t)(256 * MiB))
+// dlmalloc keeps the header of its top chunk right past the last block
+#define SNAPSHOT_SLACK ((std::size_t)(8 * sizeof(std::size_t)))
+
+struct me_memory_pool_snapshot {
+  struct me_memory_pool *pool;
+  std::size_t size;
+  uint8_t *bytes;
+};
+
+static struct me_memory_pool *create_pool(std::uint8_t *bytes, std::size_t capacity) {
+  mspace mspace_ = create_mspace_with_base(bytes, capacity, 0);
+  mspace_set_footprint_limit(mspace_, capacity);
+  struct me_memory_pool *self = static_cast<struct me_memory_pool *>(
+    mspace_malloc(mspace_, sizeof(struct me_memory_pool)));
+  self->mspace_ = mspace_;
+  self->start = bytes;
+  self->capacity = capacity;
+  self->high_water = reinterpret_cast<uint8_t *>(self + 1);
+  return self;
+}
+
+static void *track(struct me_memory_pool *self, void *block, std::size_t size) {
+  uint8_t *end = static_cast<uint8_t *>(block) + size;
+  if (block != NULL && end > self->high_water) {
+    self->high_water = end;
+  }
+  return block;
+}
 
 static std::size_t round_capacity(std::size_t capacity) {
   std::size_t page_size = (std::size_t)sysconf(_SC_PAGE_SIZE);
@@ -36,15 +68,7 @@ struct me_memory_pool *me_memory_pool_new(std::size_t capacity) {
     leave(status_code::mmap_failed);
   }
 
-  mspace mspace_ = create_mspace_with_base(bytes, rounded_capacity, 0);
-  mspace_set_footprint_limit(mspace_, rounded_capacity);
-  struct me_memory_pool *self = static_cast<struct me_memory_pool *>(
-    mspace_malloc(mspace_, sizeof(struct me_memory_pool)));
-  self->mspace_ = mspace_;
-  self->start = bytes;
-  self->capacity = rounded_capacity;
-
-  return self;
+  return create_pool(bytes, rounded_capacity);
 }
 
 struct meminfo me_memory_pool_info(struct me_memory_pool *self) {
@@ -62,17 +86,52 @@ std::size_t me_memory_pool_get_capacity(struct me_memory_pool *self) {
 }
 
 void *me_memory_pool_malloc(struct me_memory_pool *self, std::size_t size) {
-  return mspace_malloc(self->mspace_, size);
+  return track(self, mspace_malloc(self->mspace_, size), size);
 }
 
 void *me_memory_pool_realloc(struct me_memory_pool *self, void *block, std::size_t size) {
-  return mspace_realloc(self->mspace_, block, size);
+  return track(self, mspace_realloc(self->mspace_, block, size), size);
 }
 
 void me_memory_pool_free(struct me_memory_pool *self, void *block) {
   return mspace_free(self->mspace_, block);
 }
 
+struct me_memory_pool_snapshot *me_memory_pool_snapshot_new(struct me_memory_pool *self) {
+  uint8_t *end = std::min(self->high_water + SNAPSHOT_SLACK, self->start + self->capacity);
+  std::size_t size = end - self->start;
+
+  auto snapshot = static_cast<struct me_memory_pool_snapshot *>(
+    std::malloc(sizeof(struct me_memory_pool_snapshot)));
+  auto bytes = static_cast<uint8_t *>(std::malloc(size));
+  if (snapshot == NULL || bytes == NULL) {
+    leave(status_code::initialization_failure);
+  }
+  std::memcpy(bytes, self->start, size);
+  snapshot->pool = self;
+  snapshot->size = size;
+  snapshot->bytes = bytes;
+  return snapshot;
+}
+
+struct me_memory_pool *me_memory_pool_restore(
+  struct me_memory_pool *self,
+  const struct me_memory_pool_snapshot *snapshot)
+{
+  uint8_t *start = self->start;
+  uint8_t *end = start + snapshot->size;
+  if (self->high_water > end) {
+    std::memset(end, 0, self->high_water - end);
+  }
+  std::memcpy(start, snapshot->bytes, snapshot->size);
+  return snapshot->pool;
+}
+
+void me_memory_pool_snapshot_destroy(struct me_memory_pool_snapshot *snapshot) {
+  std::free(snapshot->bytes);
+  std::free(snapshot);
+}
+
 void me_memory_pool_destroy(struct me_memory_pool *self) {
   uint8_t *start = self->start;
   std::size_t capacity = self->capacity;
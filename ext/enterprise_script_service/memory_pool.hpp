@@ -11,10 +11,20 @@ struct meminfo {
 };
 
 struct me_memory_pool;
+struct me_memory_pool_snapshot;
 
 struct me_memory_pool *me_memory_pool_new(std::size_t capacity);
 void me_memory_pool_destroy(struct me_memory_pool *self);
 
+// Copies the used part of the pool, every block allocated in it included, out
+// of the pool. Restoring it brings back the pool (at the returned address) and
+// the content of all those blocks, and wipes anything allocated since.
+struct me_memory_pool_snapshot *me_memory_pool_snapshot_new(struct me_memory_pool *self);
+struct me_memory_pool *me_memory_pool_restore(
+  struct me_memory_pool *self,
+  const struct me_memory_pool_snapshot *snapshot);
+void me_memory_pool_snapshot_destroy(struct me_memory_pool_snapshot *snapshot);
+
 struct meminfo me_memory_pool_info(struct me_memory_pool *self);
 std::size_t me_memory_pool_get_capacity(struct me_memory_pool *self);
 void *me_memory_pool_malloc(struct me_memory_pool *self, std::size_t size);
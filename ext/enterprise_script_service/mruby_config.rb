@@ -18,6 +18,7 @@ MRuby::Build.new do |conf|
   conf.cc do |cc|
     cc.flags += %w(-fPIC)
     cc.flags += Flags.cflags
+    cc.flags += Flags.exception_flags
     cc.defines += Flags.io_safe_defines
   end
 
@@ -38,6 +39,7 @@ MRuby::CrossBuild.new("sandbox") do |conf|
   conf.cc do |cc|
     cc.flags += %w(-fPIC)
     cc.flags += Flags.cflags
+    cc.flags += Flags.exception_flags
     cc.defines += Flags.defines
   end
 
@@ -1,17 +1,24 @@
 #include "mruby_engine.hpp"
 #include "error.hpp"
+#include "prelude.hpp"
+#include "profiler.hpp"
+#include "vmstats.hpp"
 #include <mruby.h>
 #include <mruby/array.h>
 #include <mruby/class.h>
 #include <mruby/dump.h>
 #include <mruby/error.h>
 #include <mruby/hash.h>
+#include <mruby/irep.h>
 #include <mruby/opcode.h>
 #include <mruby/proc.h>
 #include <mruby/string.h>
 #include <mruby/throw.h>
 #include <mruby/variable.h>
+#include <sys/time.h>
+#include <chrono>
 #include <cstdlib>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <vector>
@@ -26,12 +33,66 @@ mrb_value me_mruby_engine::extract(const std::string &ivar_name) {
   return mrb_iv_get(this->state, mrb_top_self(this->state), mruby_ivar_name);
 }
 
+static void leave_engine(me_mruby_engine *engine, status_code code) __attribute__((noreturn));
+static void configure_gc(mrb_state *state, const me_gc_options &gc);
+
+static void update_instruction_limit(me_mruby_engine *engine) {
+  auto count = engine->instruction_count();
+  if (count >= engine->instruction_quota) {
+    engine->instruction_limit = 0;
+  } else if (!engine->limiting_instructions) {
+    engine->instruction_limit = UINT64_MAX;
+  } else {
+    auto left = engine->instruction_quota - count;
+    engine->instruction_limit = left > UINT64_MAX - engine->instruction_total
+      ? UINT64_MAX
+      : engine->instruction_total + left;
+  }
+}
+
+std::uint64_t me_mruby_engine::instruction_count() const {
+  if (!limiting_instructions) {
+    return counted_instructions;
+  }
+  return counted_instructions + (instruction_total - counting_since);
+}
+
+void me_mruby_engine::limit_instructions(bool limit) {
+  if (limit == limiting_instructions) {
+    return;
+  }
+  counted_instructions = instruction_count();
+  counting_since = instruction_total;
+  limiting_instructions = limit;
+  update_instruction_limit(this);
+}
+
+void me_mruby_engine::reset_instruction_count() {
+  instruction_total = 0;
+  counted_instructions = 0;
+  counting_since = 0;
+  update_instruction_limit(this);
+}
+
 void me_mruby_engine::eval(struct RProc *proc) {
   mrb_context_run(this->state, proc, mrb_top_self(this->state), 0);
   this->check_exception();
 }
 
+static void check_instruction_sequence(const std::uint8_t *data, std::size_t size) {
+  auto header = reinterpret_cast<const struct rite_binary_header *>(data);
+  if (size < sizeof(struct rite_binary_header) || size < bin_to_uint32(header->binary_size)) {
+    leave(status_code::bad_instruction_sequence);
+  }
+}
+
 struct RProc *me_mruby_engine::generate_code(const ruby_source &ruby_src) {
+  if (ruby_src.compiled) {
+    auto data = reinterpret_cast<const std::uint8_t *>(ruby_src.source.data());
+    check_instruction_sequence(data, ruby_src.source.size());
+    return this->read_instruction_sequence(data);
+  }
+
   auto context = mrbc_context_new(this->state);
   context->no_exec = true;
   context->capture_errors = true;
@@ -78,16 +139,36 @@ struct RProc *me_mruby_engine::generate_code(const ruby_source &ruby_src) {
   return proc;
 }
 
-void me_mruby_engine::load_instruction_sequence(
-  const std::vector<std::uint8_t> &data)
-{
-  auto irep = mrb_read_irep(this->state, data.data());
+void me_mruby_engine::load_instruction_sequence(const std::uint8_t *data, std::size_t size) {
+  this->eval(this->read_instruction_sequence(data, size));
+}
+
+struct RProc *me_mruby_engine::read_instruction_sequence(const std::uint8_t *data, std::size_t size) {
+  check_instruction_sequence(data, size);
+  return this->read_instruction_sequence(data);
+}
+
+std::vector<std::uint8_t> me_mruby_engine::dump_instruction_sequence(struct RProc *proc) {
+  std::uint8_t *bin = nullptr;
+  std::size_t bin_size = 0;
+  if (mrb_dump_irep(this->state, proc->body.irep, DUMP_DEBUG_INFO, &bin, &bin_size) != MRB_DUMP_OK) {
+    leave(status_code::code_generation_failure);
+  }
+
+  std::vector<std::uint8_t> data{bin, bin + bin_size};
+  mrb_free(this->state, bin);
+  return data;
+}
+
+struct RProc *me_mruby_engine::read_instruction_sequence(const std::uint8_t *data) {
+  auto irep = mrb_read_irep(this->state, data);
   if (irep == nullptr) {
     leave(status_code::bad_instruction_sequence);
   }
 
   auto proc = mrb_proc_new(this->state, irep);
-  this->eval(proc);
+  mrb_irep_decref(this->state, irep); // now owned by proc
+  return proc;
 }
 
 void me_mruby_engine::check_exception() {
@@ -140,6 +221,9 @@ static void *mruby_engine_allocf(struct mrb_state *state, void *block, size_t si
 
   if (size == 0) {
     if (block != NULL) {
+      if (engine->profile != nullptr) {
+        engine->profile->count_free(block);
+      }
       me_memory_pool_free(engine->allocator, block);
     }
     return NULL;
@@ -152,7 +236,10 @@ static void *mruby_engine_allocf(struct mrb_state *state, void *block, size_t si
   }
 
   if (block == NULL) {
-    leave(status_code::memory_quota_reached);
+    leave_engine(engine, status_code::memory_quota_reached);
+  }
+  if (engine->profile != nullptr) {
+    engine->profile->count_allocation(size);
   }
   return block;
 }
@@ -161,6 +248,32 @@ bool me_mruby_engine_get_quota_exception_raised(struct me_mruby_engine *self) {
   return self->quota_error_raised;
 }
 
+#ifdef ME_WRAP_OBJ_ALLOC
+// Allocations are what step the collector along: the ones that do are timed.
+extern "C" struct RBasic *__real_mrb_obj_alloc(mrb_state *mrb, enum mrb_vtype ttype, struct RClass *cls);
+
+extern "C" struct RBasic *__wrap_mrb_obj_alloc(mrb_state *mrb, enum mrb_vtype ttype, struct RClass *cls) {
+  auto engine = reinterpret_cast<me_mruby_engine *>(mrb->allocf_ud);
+  auto &gc = mrb->gc;
+  struct RBasic *object;
+  if (gc.disabled || gc.live <= gc.threshold) {
+    object = __real_mrb_obj_alloc(mrb, ttype, cls);
+  } else {
+    auto start = std::chrono::steady_clock::now();
+    object = __real_mrb_obj_alloc(mrb, ttype, cls);
+    engine->gc_time_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+    if (gc.state == MRB_GC_STATE_ROOT) {
+      engine->gc_cycles++; // the step swept the last of a cycle
+    }
+  }
+  if (gc.live > engine->peak_live_objects) {
+    engine->peak_live_objects = gc.live;
+  }
+  return object;
+}
+#endif
+
 static void mruby_engine_code_fetch_hook(
   struct mrb_state* mrb,
   struct mrb_irep *irep,
@@ -173,14 +286,38 @@ static void mruby_engine_code_fetch_hook(
 
   auto engine = reinterpret_cast<me_mruby_engine *>(mrb->allocf_ud);
 
-  if (engine->instruction_count >= engine->instruction_quota) {
-    leave(status_code::instruction_quota_reached);
+  if (engine->time_quota_reached) {
+    if (engine->wrap_up != nullptr) {
+      engine->wrap_up(engine, engine->emit_context);
+    }
+    leave_engine(engine, status_code::time_quota_reached);
   }
-
-  engine->instruction_total++;
-  if (engine->limit_instructions) {
-    engine->instruction_count++;
+  if (engine->instruction_total >= engine->instruction_limit) {
+    leave_engine(engine, status_code::instruction_quota_reached);
   }
+  engine->instruction_total++;
+#ifdef ME_ENABLE_VMSTATS
+  engine->vmstats->count(irep, pc);
+#endif
+}
+
+static void mruby_engine_profiling_code_fetch_hook(
+  struct mrb_state* mrb,
+  struct mrb_irep *irep,
+  mrb_code *pc,
+  mrb_value *regs)
+{
+  mruby_engine_code_fetch_hook(mrb, irep, pc, regs);
+  auto engine = reinterpret_cast<me_mruby_engine *>(mrb->allocf_ud);
+  engine->profile->count_instruction(mrb, irep);
+}
+
+// the engine whose time is limited: signal handlers get no context
+static me_mruby_engine *timed_engine = nullptr;
+
+static void mruby_engine_time_quota_reached(int) {
+  // only the flag is shared with the engine: it stops on its next instruction
+  timed_engine->time_quota_reached = 1;
 }
 
 static mrb_value mruby_engine_exit(struct mrb_state *state, mrb_value rvalue) {
@@ -188,13 +325,37 @@ static mrb_value mruby_engine_exit(struct mrb_state *state, mrb_value rvalue) {
   return rvalue;
 }
 
+static mrb_value mruby_engine_emit(struct mrb_state *mrb, mrb_value) {
+  mrb_value value;
+  mrb_get_args(mrb, "o", &value);
+
+  auto engine = reinterpret_cast<me_mruby_engine *>(mrb->allocf_ud);
+  if (engine->emit == nullptr) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "nothing to emit to");
+  }
+  // raised from here rather than from emit: no C++ frame is unwound
+  auto error = engine->emit(engine, value, engine->emit_context);
+  if (error != nullptr) {
+    mrb_raise(mrb, E_TYPE_ERROR, error);
+  }
+  return mrb_nil_value();
+}
+
 struct me_mruby_engine *me_mruby_engine_new(
   struct me_memory_pool *allocator,
-  uint64_t instruction_quota)
+  uint64_t instruction_quota,
+  const struct me_gc_options *gc)
 {
   auto self = reinterpret_cast<me_mruby_engine *>(
     me_memory_pool_malloc(allocator, sizeof(struct me_mruby_engine)));
   self->allocator = allocator;
+  self->profile = nullptr; // read by the allocator
+  self->gc_cycles = 0;
+  self->gc_time_ns = 0;
+  self->peak_live_objects = 0;
+#ifdef ME_ENABLE_VMSTATS
+  self->vmstats = new vmstats();
+#endif
   self->state = mrb_open_allocf(mruby_engine_allocf, self);
 
   if (self->state == nullptr) {
@@ -203,23 +364,77 @@ struct me_mruby_engine *me_mruby_engine_new(
 
   mrb_define_class(self->state, "ExitException", mrb_class_get(self->state, "Exception"));
   mrb_define_method(self->state , self->state->kernel_module, "exit", mruby_engine_exit, 1);
+  mrb_define_method(self->state , self->state->kernel_module, "emit", mruby_engine_emit, MRB_ARGS_REQ(1));
+  self->emit = nullptr;
+  self->emit_context = nullptr;
+  self->wrap_up = nullptr;
+  self->time_quota_reached = 0;
+  if (gc != nullptr) {
+    configure_gc(self->state, *gc);
+  }
+
+  // before the hook is set: the prelude doesn't count against any quota
+  if (ess_prelude_size > 0) {
+    try {
+      self->eval(self->read_instruction_sequence(ess_prelude));
+    } catch (error_base &) {
+      leave(status_code::initialization_failure);
+    }
+  }
 
   self->instruction_quota = instruction_quota;
-  self->instruction_count = 0;
-  self->instruction_total = 0;
+  self->limiting_instructions = true;
+  self->reset_instruction_count();
   self->execution_time_us = 0;
-  self->limit_instructions = true;
   self->quota_error_raised = false;
   self->state->code_fetch_hook = mruby_engine_code_fetch_hook;
   self->ctx_switches_v = -1;
   self->ctx_switches_iv = -1;
   self->cpu_time_ns = 0;
+  self->deduplicated_bytes = 0;
+  me_mruby_engine_reset_gc_stats(self);
 
   return self;
 }
 
+void me_mruby_engine_reset_gc_stats(struct me_mruby_engine *self) {
+  self->gc_cycles = 0;
+  self->gc_time_ns = 0;
+  self->peak_live_objects = self->state->gc.live;
+}
+
+void me_mruby_engine_limit_time(struct me_mruby_engine *self, uint64_t time_quota_ms) {
+  timed_engine = self;
+
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = mruby_engine_time_quota_reached;
+  action.sa_flags = SA_RESTART; // reads carry on
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, nullptr) == -1) {
+    leave(status_code::initialization_failure);
+  }
+
+  struct itimerval timer;
+  timer.it_value.tv_sec = static_cast<time_t>(time_quota_ms / 1000);
+  timer.it_value.tv_usec = static_cast<suseconds_t>(time_quota_ms % 1000 * 1000);
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = 0;
+  if (setitimer(ITIMER_PROF, &timer, nullptr) == -1) {
+    leave(status_code::initialization_failure);
+  }
+}
+
+void me_mruby_engine_profile(struct me_mruby_engine *self, profiler *profile) {
+  self->profile = profile;
+  self->state->code_fetch_hook = mruby_engine_profiling_code_fetch_hook;
+}
+
 void me_mruby_engine_destroy(struct me_mruby_engine *self) {
   struct me_memory_pool *allocator = me_mruby_engine_get_allocator(self);
+#ifdef ME_ENABLE_VMSTATS
+  delete self->vmstats;
+#endif
   mrb_close(self->state);
   me_memory_pool_free(allocator, self);
 }
@@ -229,7 +444,7 @@ struct me_memory_pool *me_mruby_engine_get_allocator(struct me_mruby_engine *sel
 }
 
 uint64_t me_mruby_engine_get_instruction_count(struct me_mruby_engine *self) {
-  return self->instruction_count;
+  return self->instruction_count();
 }
 
 struct meminfo me_mruby_engine_get_memory_info(struct me_mruby_engine *self) {
@@ -247,3 +462,27 @@ int64_t me_mruby_engine_get_ctx_switches_involuntary(struct me_mruby_engine *sel
 int64_t me_mruby_engine_get_cpu_time(struct me_mruby_engine *self) {
   return self->cpu_time_ns;
 }
+
+void leave_engine(me_mruby_engine *engine, status_code code) {
+  if (engine->profile != nullptr) {
+    engine->profile->emit();
+  }
+  leave(code);
+}
+
+void configure_gc(mrb_state *state, const me_gc_options &gc) {
+  if (gc.interval_ratio > 0) {
+    state->gc.interval_ratio = gc.interval_ratio;
+  }
+  if (gc.step_ratio > 0) {
+    state->gc.step_ratio = gc.step_ratio;
+  }
+  if (gc.generational >= 0) {
+    // switching modes takes a full collection, which GC does on the way
+    auto module = mrb_obj_value(mrb_module_get(state, "GC"));
+    mrb_funcall(state, module, "generational_mode=", 1, mrb_bool_value(gc.generational > 0));
+    if (state->exc != nullptr) {
+      leave(status_code::initialization_failure);
+    }
+  }
+}
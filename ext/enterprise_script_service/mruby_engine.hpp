@@ -4,44 +4,95 @@
 #include "units.hpp"
 #include "memory_pool.hpp"
 #include <mruby.h>
+#include <csignal>
 #include <cstdint>
 #include <string>
 #include <vector>
 
+class profiler;
+class vmstats;
+
 struct ruby_source {
-  ruby_source(std::string path_, std::string source_)
+  ruby_source(std::string path_, std::string source_, bool compiled_ = false)
       : path(path_)
-      , source(source_) { }
+      , source(source_)
+      , compiled(compiled_) { }
 
   std::string path;
-  std::string source;
+  std::string source; // instruction sequence when compiled
+  bool compiled;
+};
+
+// How the engine's garbage collector runs; zeroes (and a negative
+// `generational`) keep mruby's defaults.
+struct me_gc_options {
+  int interval_ratio; // % of the objects live after a cycle to wait for
+  int step_ratio;     // % of the objects allocated since that a step visits
+  int generational;   // 1 for generational mode, 0 for incremental
 };
 
 struct me_mruby_engine {
   void inject(const std::string &ivar_name, mrb_value &value);
   mrb_value extract(const std::string &ivar_name);
   struct RProc *generate_code(const ruby_source &ruby_src);
-  void load_instruction_sequence(const std::vector<std::uint8_t> &data);
+  void load_instruction_sequence(const std::uint8_t *data, std::size_t size);
+  struct RProc *read_instruction_sequence(const std::uint8_t *data);
+  struct RProc *read_instruction_sequence(const std::uint8_t *data, std::size_t size);
+  std::vector<std::uint8_t> dump_instruction_sequence(struct RProc *proc);
   void eval(struct RProc *proc);
   void check_exception();
+  // The instructions counted against the quota: those run while limiting.
+  std::uint64_t instruction_count() const;
+  void limit_instructions(bool limit);
+  void reset_instruction_count(); // also applies a new instruction_quota
 
   struct mrb_state *state;
   struct me_memory_pool *allocator;
 
   std::uint64_t instruction_total;
-  std::uint64_t instruction_count;
   std::uint64_t instruction_quota;
   std::uint64_t execution_time_us;
-  bool limit_instructions;
   bool quota_error_raised;
   std::int64_t ctx_switches_v;
   std::int64_t ctx_switches_iv;
   std::int64_t cpu_time_ns;
+  // bytes of input strings shared rather than allocated again
+  std::uint64_t deduplicated_bytes;
+  // Hands over the values passed to Kernel#emit, returning why one can't be
+  // emitted, if so. emit raises when unset.
+  const char *(*emit)(struct me_mruby_engine *engine, mrb_value value, void *context);
+  void *emit_context;
+  // Writes out whatever is due before leaving over the time quota, if set;
+  // gets emit_context.
+  void (*wrap_up)(struct me_mruby_engine *engine, void *context);
+  // Set by the time quota's signal handler, which touches nothing else;
+  // checked before every instruction.
+  volatile std::sig_atomic_t time_quota_reached;
+  // Collector cycles, the time spent in them and the most objects live, as
+  // seen by allocations from outside of gc.c: only counted when linked with
+  // --wrap=mrb_obj_alloc (ME_WRAP_OBJ_ALLOC).
+  std::uint64_t gc_cycles;
+  std::uint64_t gc_time_ns;
+  std::size_t peak_live_objects;
+  class profiler *profile; // unless null, fed every instruction and allocation
+#ifdef ME_ENABLE_VMSTATS
+  class vmstats *vmstats;
+#endif
+
+  // Past time_quota_reached, the fetch hook only bumps instruction_total and
+  // compares it against instruction_limit, the total at which the quota is
+  // reached (never, while not limiting): the count is derived from the
+  // total when needed.
+  std::uint64_t instruction_limit;
+  std::uint64_t counted_instructions; // until limiting last started
+  std::uint64_t counting_since;       // instruction_total when it did
+  bool limiting_instructions;
 };
 
 struct me_mruby_engine *me_mruby_engine_new(
   struct me_memory_pool *allocator,
-  uint64_t instruction_limit);
+  uint64_t instruction_limit,
+  const struct me_gc_options *gc = nullptr);
 void me_mruby_engine_destroy(struct me_mruby_engine *self);
 
 struct me_memory_pool *me_mruby_engine_get_allocator(struct me_mruby_engine *self);
@@ -51,5 +102,9 @@ int64_t me_mruby_engine_get_ctx_switches_voluntary(struct me_mruby_engine *self)
 int64_t me_mruby_engine_get_ctx_switches_involuntary(struct me_mruby_engine *self);
 int64_t me_mruby_engine_get_cpu_time(struct me_mruby_engine *self);
 bool me_mruby_engine_get_quota_exception_raised(struct me_mruby_engine *self);
+void me_mruby_engine_reset_gc_stats(struct me_mruby_engine *self);
+void me_mruby_engine_limit_time(struct me_mruby_engine *self, uint64_t time_quota_ms);
+// Feeds `profile`, which is emitted before leaving over any quota, from then on.
+void me_mruby_engine_profile(struct me_mruby_engine *self, class profiler *profile);
 
 #endif
@@ -5,16 +5,19 @@
 #include <string>
 #include <iostream>
 #include <stdexcept>
+#include <climits>
 #include "options.hpp"
 #include "units.hpp"
 
 static const std::uint64_t DEFAULT_INSTRUCTION_QUOTA = 100000;
 static const std::uint64_t MIN_INSTRUCTION_QUOTA = 6000;
 static const std::size_t DEFAULT_MEMORY_QUOTA = 8 * MiB;
+static const std::uint64_t MIN_CODE_CACHE_SIZE = 256 * KiB;
+static const std::uint64_t MAX_CODE_CACHE_SIZE = 256 * MiB;
  
 void options::read_from(int argc, char **argv, std::ostream &output) {
   int opt;
-  while ((opt = getopt(argc, argv, "i:C:m:")) != -1) {
+  while ((opt = getopt(argc, argv, "i:C:m:t:zwcPk:I:O:r:s:G:")) != -1) {
     switch(opt) {
       case 'i':
         parse(output, this->instruction_quota_, "instruction quota (-i)");
@@ -34,10 +37,71 @@ void options::read_from(int argc, char **argv, std::ostream &output) {
         this->memory_quota_ = (size_t) (value < SIZE_MAX ? value : SIZE_MAX);
         break;
       }
+      case 't':
+        parse(output, this->time_quota_, "time quota (-t)");
+        break;
+      case 'z':
+        this->fork_server_ = true;
+        break;
+      case 'w':
+        this->worker_ = true;
+        break;
+      case 'c':
+        this->compile_ = true;
+        break;
+      case 'P':
+        this->profile_ = true;
+        break;
+      case 'k': {
+        uint64_t value = 0;
+        parse(output, value, "code cache size (-k)");
+        if (value != 0 && (value < MIN_CODE_CACHE_SIZE || MAX_CODE_CACHE_SIZE < value)) {
+          // the cache's pool would fail to be created
+          output << "Code cache size (-k) must be between " << MIN_CODE_CACHE_SIZE
+            << " and " << MAX_CODE_CACHE_SIZE << " bytes, not: " << optarg
+            << " (its pool isn't charged against the memory quota, -m)" << "\n";
+          this->valid_ = false;
+          break;
+        }
+        this->code_cache_size_ = (size_t) value;
+        break;
+      }
+      case 'r':
+        parse_ratio(output, this->gc_interval_ratio_, "GC interval ratio (-r)");
+        break;
+      case 's':
+        parse_ratio(output, this->gc_step_ratio_, "GC step ratio (-s)");
+        break;
+      case 'G':
+        if (std::string{optarg} == "generational") {
+          this->gc_generational_ = 1;
+        } else if (std::string{optarg} == "incremental") {
+          this->gc_generational_ = 0;
+        } else {
+          output << "Could not parse GC mode (-G) from: " << optarg << " (generational or incremental)" << "\n";
+        }
+        break;
+      case 'I':
+        parse_fd(output, this->input_fd_, "input memfd (-I)");
+        break;
+      case 'O':
+        parse_fd(output, this->output_fd_, "output memfd (-O)");
+        break;
       default: ; // noop
     }
   }
 
+  if (this->worker_ && (this->time_quota_ > 0 || this->profile_)) {
+    // neither is set up per request, the timer being off limits once sandboxed
+    output << "Time quota (-t) and profiling (-P) don't apply to the worker (-w)" << "\n";
+    this->valid_ = false;
+  }
+  if (!this->worker_ && this->code_cache_size_ > 0) {
+    // only the worker outlives a request, and so a cache
+    output << "Code cache size (-k) only applies to the worker (-w), its pool coming on top of the memory quota (-m)" << "\n";
+    this->valid_ = false;
+  }
+
   optind = 1; // In case we call getopt multiple times like in testing
 
   // Note; Getopt will output parameter errors to stderr. 
@@ -54,10 +118,42 @@ void options::parse(std::ostream &output, uint64_t &to, const std::string &optio
   }
 }
 
+void options::parse_fd(std::ostream &output, int &to, const std::string &option) {
+  uint64_t value = UINT64_MAX;
+  parse(output, value, option);
+  if (value <= INT_MAX) {
+    to = (int) value;
+  } else if (value != UINT64_MAX) {
+    output << "Could not parse " << option << " from: " << optarg << " (out of range)" << "\n";
+  }
+}
+
+void options::parse_ratio(std::ostream &output, int &to, const std::string &option) {
+  uint64_t value = 0;
+  parse(output, value, option);
+  if (value <= INT_MAX) {
+    to = (int) value;
+  } else {
+    output << "Could not parse " << option << " from: " << optarg << " (out of range)" << "\n";
+  }
+}
+
 options::options() {
   memory_quota_ = DEFAULT_MEMORY_QUOTA;
+  time_quota_ = 0;
   instruction_quota_ = DEFAULT_INSTRUCTION_QUOTA;
   instruction_quota_start_ = 0;
+  fork_server_ = false;
+  worker_ = false;
+  compile_ = false;
+  profile_ = false;
+  gc_interval_ratio_ = 0;
+  gc_step_ratio_ = 0;
+  gc_generational_ = -1;
+  code_cache_size_ = 0;
+  input_fd_ = -1;
+  output_fd_ = -1;
+  valid_ = true;
 }
 
 uint64_t options::instruction_quota() {
@@ -71,3 +167,54 @@ uint32_t options::instruction_quota_start() {
 size_t options::memory_quota() {
   return memory_quota_;
 }
+
+// CPU time, in milliseconds; none when 0
+uint64_t options::time_quota() {
+  return time_quota_;
+}
+
+bool options::fork_server() {
+  return fork_server_;
+}
+
+bool options::worker() {
+  return worker_;
+}
+
+bool options::compile() {
+  return compile_;
+}
+
+bool options::profile() {
+  return profile_;
+}
+
+// percentages; mruby's own when 0
+int options::gc_interval_ratio() {
+  return gc_interval_ratio_;
+}
+
+int options::gc_step_ratio() {
+  return gc_step_ratio_;
+}
+
+// 1 for generational, 0 for incremental, -1 for mruby's default
+int options::gc_generational() {
+  return gc_generational_;
+}
+
+size_t options::code_cache_size() {
+  return code_cache_size_;
+}
+
+int options::input_fd() {
+  return input_fd_;
+}
+
+int options::output_fd() {
+  return output_fd_;
+}
+
+bool options::valid() {
+  return valid_;
+}
@@ -19,13 +19,40 @@ public:
   void read_from(int argc, char **argv, std::ostream &output = std::cerr);
 
   size_t memory_quota();
+  uint64_t time_quota();
+  bool fork_server();
+  bool worker();
+  bool compile();
+  bool profile();
+  int gc_interval_ratio();
+  int gc_step_ratio();
+  int gc_generational();
+  size_t code_cache_size();
+  int input_fd();
+  int output_fd();
+  // false when the options can't go together, as reported by read_from
+  bool valid();
 
 private:
   uint64_t instruction_quota_;
   uint32_t instruction_quota_start_;
   size_t memory_quota_;
+  uint64_t time_quota_;
+  bool fork_server_;
+  bool worker_;
+  bool compile_;
+  bool profile_;
+  int gc_interval_ratio_;
+  int gc_step_ratio_;
+  int gc_generational_;
+  size_t code_cache_size_;
+  int input_fd_;
+  int output_fd_;
+  bool valid_;
 
   inline void parse(std::ostream &output, uint64_t &to, const std::string &option = "option");
+  inline void parse_ratio(std::ostream &output, int &to, const std::string &option);
+  inline void parse_fd(std::ostream &output, int &to, const std::string &option);
 };
 
 #endif
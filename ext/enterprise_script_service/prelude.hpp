@@ -0,0 +1,12 @@
+#ifndef ENTERPRISE_SCRIPT_SERVICE_PRELUDE_HPP
+#define ENTERPRISE_SCRIPT_SERVICE_PRELUDE_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// Instruction sequence compiled by `rake prelude.cpp` from the Ruby files
+// listed in ESS_PRELUDE, and loaded into every engine; empty by default.
+extern const std::uint8_t ess_prelude[];
+extern const std::size_t ess_prelude_size;
+
+#endif
@@ -0,0 +1,137 @@
+#include "profiler.hpp"
+#include <mruby/proc.h>
+#include <algorithm>
+#include <cstdint>
+
+static const std::size_t SETUP = SIZE_MAX;
+
+profiler::profiler(data_writer &writer, std::size_t entries)
+    : writer_(writer), entries_(entries), state_(nullptr), setup_{0, 0}, source_(&setup_),
+      source_index_(SETUP), irep_(nullptr), irep_entry_(nullptr), emitted_(false) { }
+
+void profiler::enter_setup() {
+  source_ = &setup_;
+  source_index_ = SETUP;
+}
+
+void profiler::enter_source(std::size_t index) {
+  if (sources_.size() <= index) {
+    sources_.resize(index + 1, entry{0, 0});
+  }
+  source_ = &sources_[index];
+  source_index_ = index;
+}
+
+void profiler::count_instruction(struct mrb_state *mrb, const struct mrb_irep *irep) {
+  if (irep != irep_) {
+    auto found = ireps_.find(irep);
+    if (found == ireps_.end()) {
+      // a block runs with the mid of the method that called it: only
+      // methods, lambdas included, are strict
+      auto ci = mrb->c->ci;
+      auto block = ci != mrb->c->cibase && !MRB_PROC_STRICT_P(ci->proc);
+      state_ = mrb;
+      found = ireps_.emplace(irep, irep_entry{{0, 0}, block ? 0 : ci->mid, source_index_, block}).first;
+    }
+    irep_ = irep;
+    irep_entry_ = &found->second; // nodes stay put as the map grows
+  }
+  irep_entry_->counts.instructions++;
+  source_->instructions++;
+}
+
+void profiler::count_allocation(std::size_t bytes) {
+  source_->bytes += bytes;
+  if (irep_entry_ != nullptr) {
+    irep_entry_->counts.bytes += bytes;
+  }
+}
+
+void profiler::count_free(const void *block) {
+  auto found = ireps_.find(block);
+  if (found == ireps_.end()) {
+    return;
+  }
+  if (irep_entry_ == &found->second) {
+    irep_ = nullptr;
+    irep_entry_ = nullptr;
+  }
+  freed_.push_back(found->second);
+  ireps_.erase(found);
+}
+
+void profiler::emit() noexcept {
+  if (emitted_) {
+    return;
+  }
+  emitted_ = true;
+
+  std::vector<const irep_entry *> methods, blocks;
+  for (auto &&irep : ireps_) {
+    (irep.second.block ? blocks : methods).push_back(&irep.second);
+  }
+  for (auto &&irep : freed_) {
+    (irep.block ? blocks : methods).push_back(&irep);
+  }
+
+  auto &packer = writer_.packer;
+  packer.pack_array(2);
+  packer.pack(symbol{"profile"});
+  packer.pack_map(4);
+  packer.pack(symbol{"setup"});
+  pack(setup_);
+  packer.pack(symbol{"sources"});
+  packer.pack_array(sources_.size());
+  for (auto &&source : sources_) {
+    pack(source);
+  }
+  packer.pack(symbol{"methods"});
+  pack(methods);
+  packer.pack(symbol{"blocks"});
+  pack(blocks);
+}
+
+void profiler::pack(const entry &counts) {
+  auto &packer = writer_.packer;
+  packer.pack_map(2);
+  packer.pack(symbol{"instructions"});
+  packer.pack_uint64(counts.instructions);
+  packer.pack(symbol{"bytes"});
+  packer.pack_uint64(counts.bytes);
+}
+
+void profiler::pack(const std::vector<const irep_entry *> &ireps) {
+  // the busiest ones, first
+  auto top = ireps;
+  auto count = std::min(entries_, top.size());
+  std::partial_sort(top.begin(), top.begin() + count, top.end(), [](const irep_entry *a, const irep_entry *b) {
+    return a->counts.instructions > b->counts.instructions;
+  });
+
+  auto &packer = writer_.packer;
+  packer.pack_array(count);
+  for (std::size_t i = 0; i < count; ++i) {
+    auto irep = top[i];
+    packer.pack_map(irep->block ? 3 : 4);
+    if (!irep->block) {
+      packer.pack(symbol{"method"});
+      if (irep->method == 0) {
+        packer.pack_nil();
+      } else {
+        mrb_int length;
+        auto name = mrb_sym2name_len(state_, irep->method, &length);
+        packer.pack(symbol{std::string{name, static_cast<std::size_t>(length)}});
+      }
+    }
+    packer.pack(symbol{"source"});
+    if (irep->source == SETUP) {
+      packer.pack_nil();
+    } else {
+      packer.pack_uint64(irep->source);
+    }
+    packer.pack(symbol{"instructions"});
+    packer.pack_uint64(irep->counts.instructions);
+    packer.pack(symbol{"bytes"});
+    packer.pack_uint64(irep->counts.bytes);
+  }
+}
@@ -0,0 +1,62 @@
+#ifndef ENTERPRISE_SCRIPT_SERVICE_PROFILER_HPP
+#define ENTERPRISE_SCRIPT_SERVICE_PROFILER_HPP
+
+#include "data.hpp"
+#include <mruby.h>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Attributes the instructions the engine runs, and the bytes it asks its
+// allocator for, to the source being run and to the irep (method or block
+// body) being executed. Fed by the engine's code fetch hook and allocator;
+// see me_mruby_engine_profile. Ireps are told apart by address while they
+// live: one that is freed keeps its counts, apart from whatever comes next
+// at its address.
+class profiler {
+public:
+  // Reports the `entries` ireps that ran the most instructions.
+  profiler(data_writer &writer, std::size_t entries);
+
+  // Whatever runs before the sources (the library, decoding the input) is
+  // counted as setup.
+  void enter_setup();
+  void enter_source(std::size_t index);
+  void count_instruction(struct mrb_state *mrb, const struct mrb_irep *irep);
+  void count_allocation(std::size_t bytes);
+  // For every block the engine frees, ireps included.
+  void count_free(const void *block);
+  // A [:profile, {setup:, sources:, methods:, blocks:}] message; only the
+  // first call emits anything.
+  void emit() noexcept;
+
+private:
+  struct entry {
+    std::uint64_t instructions;
+    std::uint64_t bytes;
+  };
+  struct irep_entry {
+    entry counts;
+    mrb_sym method; // where first run, unless a block's
+    std::size_t source;
+    bool block;
+  };
+
+  void pack(const entry &counts);
+  void pack(const std::vector<const irep_entry *> &ireps);
+
+  data_writer &writer_;
+  std::size_t entries_;
+  struct mrb_state *state_;
+  entry setup_;
+  std::vector<entry> sources_;
+  std::unordered_map<const void *, irep_entry> ireps_;
+  std::vector<irep_entry> freed_;
+  entry *source_;
+  std::size_t source_index_;
+  const struct mrb_irep *irep_;
+  irep_entry *irep_entry_;
+  bool emitted_;
+};
+
+#endif
@@ -17,9 +17,12 @@
 #include <sys/resource.h>
 #include <linux/seccomp.h>
 
-void reserve_memory() {
+void reserve_memory(bool reads_sandboxed) {
   mallopt(M_TRIM_THRESHOLD, 64 * MiB);
-  free(malloc(32 * MiB));
+  if (reads_sandboxed) {
+    mallopt(M_MMAP_MAX, 0); // mmap is off limits once sandboxed
+  }
+  free(malloc(RESERVED_HEAP_SIZE));
 }
 
 static void check_seccomp(int result) {
@@ -38,6 +41,9 @@ void sandbox() {
 
   check_seccomp(seccomp_rule_add_exact(
     context, SCMP_ACT_ALLOW, SCMP_SYS(exit), 0));
+  // returning from the time quota's SIGPROF handler
+  check_seccomp(seccomp_rule_add_exact(
+    context, SCMP_ACT_ALLOW, SCMP_SYS(rt_sigreturn), 0));
   check_seccomp(seccomp_rule_add_exact(
     context, SCMP_ACT_ALLOW, SCMP_SYS(read), 1,
     SCMP_A0(SCMP_CMP_EQ, STDIN_FILENO)));
@@ -47,6 +53,9 @@ void sandbox() {
   check_seccomp(seccomp_rule_add_exact(
     context, SCMP_ACT_ALLOW, SCMP_SYS(write), 1,
     SCMP_A0(SCMP_CMP_EQ, STDERR_FILENO)));
+  check_seccomp(seccomp_rule_add_exact(
+    context, SCMP_ACT_ALLOW, SCMP_SYS(writev), 1,
+    SCMP_A0(SCMP_CMP_EQ, STDOUT_FILENO)));
 
   check_seccomp(seccomp_load(context));
   seccomp_release(context);
@@ -54,7 +63,7 @@ void sandbox() {
 
 #else
 
-void reserve_memory() {}
+void reserve_memory(bool) {}
 void sandbox() {}
 
 #endif
@@ -1,7 +1,18 @@
 #ifndef ENTERPRISE_SCRIPT_SERVICE_SANDBOX_HPP
 #define ENTERPRISE_SCRIPT_SERVICE_SANDBOX_HPP
 
-void reserve_memory();
+#include "units.hpp"
+#include <cstddef>
+
+static const std::size_t RESERVED_HEAP_SIZE = 32 * MiB;
+// The largest payload read once sandboxed: the rest of the reserved heap is
+// left for what is unpacked and indexed from it.
+static const std::size_t MAX_PAYLOAD_SIZE = RESERVED_HEAP_SIZE / 2;
+
+// A process that keeps reading once sandboxed, serving requests or the rest
+// of its payload: all of its later allocations must then come out of the
+// heap reserved here.
+void reserve_memory(bool reads_sandboxed = false);
 void sandbox();
 
 #endif
@@ -5,64 +5,395 @@
 #include "script_data.hpp"
 
 #include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <unordered_map>
 #include <mruby/array.h>
+#include <mruby/class.h>
+#include <mruby/data.h>
 #include <mruby/hash.h>
+#include <mruby/variable.h>
 #include "error.hpp"
 #include "data.hpp"
+#include "sandbox.hpp"
 
 static const std::size_t FIRST_CHUNK_SIZE = 4; // big enough to read a uint64_t from msgpack, given our sizes
 static const std::size_t MSGPACK_CHUNK_SIZE = 256 * KiB; // ~ msgpack size to then blow the 4MB mem quota
+static const int MAX_DEPTH = 32;
+static const std::uint32_t MAX_SHARED_STRING_SIZE = 64;
+
+// A sectioned payload starts with a fixed-size header: 0xc1 (never used by
+// msgpack) "ESS", a version, 3 reserved bytes and the size of the body that
+// follows, then an offset into the body and a size for each section. All
+// sizes and offsets are big-endian uint64; an empty section is absent.
+static const char HEADER_MAGIC[] = {'\xc1', 'E', 'S', 'S'};
+static const char HEADER_VERSION = 1;
+static const std::size_t SECTION_TABLE = 16;
+enum section : std::size_t { INPUT_SECTION, SOURCES_SECTION, LIBRARY_SECTION, OPTIONS_SECTION, SECTION_COUNT };
+static const std::size_t HEADER_SIZE = SECTION_TABLE + SECTION_COUNT * 16;
+static const std::size_t NO_VALUE = SIZE_MAX;
 
 static bool equal_to_symbol_p(const msgpack::object &object, const std::string &string);
-static msgpack::object find_in(const msgpack::object &handle, const char string[6]);
 
 static std::vector<ruby_source> unpack_sources(const msgpack::object &object);
-static std::vector<std::uint8_t> fetch_library(const msgpack::object &object);
+static byte_range fetch_library(const msgpack::object &object);
+static bool reference_payload(msgpack::type::object_type type, std::size_t size, void *data);
 
-static mrb_value msgpack_to_ruby(me_mruby_engine &engine, const msgpack::object &msgpack_value, int depth = 0);
+static bool size_hint_p(char marker);
+static std::size_t size_hint_width(std::uint8_t marker);
+static std::uint64_t big_endian(const char *bytes, std::size_t width);
+static bool skip_value(const char *data, std::size_t size, std::size_t &offset);
+static bool container_header(const char *data, std::size_t &offset, bool map, std::uint32_t &size);
+static mrb_value decode(me_mruby_engine &engine, const char *data, std::size_t size, std::size_t &offset, bool dedup_strings = false);
+static mrb_value lazy_value(me_mruby_engine &engine, const char *data, std::size_t size, std::size_t &offset, int depth);
 
+static bool read_fully(int fd, char *buffer, std::size_t size);
 
-void script_data::read_from(int fd) {
-  msgpack::unpacker unpacker;
-  msgpack::object sources;
-  msgpack::object library;
+
+void script_data::read_from(int fd, bool input_required, const std::function<void()> &sources_read) {
+  if (read_start_from(fd, input_required)) {
+    read_rest_from(fd, input_required, sources_read);
+  }
+}
+
+bool script_data::read_start_from(int fd, bool input_required) {
   size_t expected_size = FIRST_CHUNK_SIZE;
+  std::size_t start = 0; // of the payload, past its size hint
+  std::size_t wanted = 0; // bytes to read before looking for the end of the payload
 
-  in_ = 0;
+  buffer_.clear();
   for (;;) {
-    unpacker.reserve_buffer(expected_size);
-    auto input_size = read(fd, unpacker.buffer(), expected_size);
+    auto used = buffer_.size();
+    buffer_.resize(used + expected_size);
+    auto input_size = read(fd, &buffer_[used], expected_size);
     if (input_size < 0) {
       throw fatal_error(status_code::io_failure);
     }
-    in_ += input_size;
-    if (expected_size <= FIRST_CHUNK_SIZE && in_ > 0) {
-      // done with first chunk, fallback to larger chunks in case we don't get a size hint
-      expected_size = MSGPACK_CHUNK_SIZE;
+    buffer_.resize(used + input_size);
+    if (input_size == 0) {
+      throw fatal_error(status_code::bad_input); // truncated
+    }
+    if (used == 0 && buffer_[0] == HEADER_MAGIC[0]) {
+      // not msgpack: sectioned payloads are sized by their header
+      read_header(fd);
+      return true;
+    }
+    // done with first chunk, fallback to larger chunks in case we don't get a size hint
+    expected_size = MSGPACK_CHUNK_SIZE;
+
+    if (start == 0 && size_hint_p(buffer_[0])) {
+      // we got a payload size hint! Use that to read the whole payload before parsing it
+      auto width = size_hint_width(static_cast<std::uint8_t>(buffer_[0]));
+      if (buffer_.size() < 1 + width) {
+        continue;
+      }
+      start = 1 + width;
+      wanted = start + (width == 0 ? static_cast<std::uint8_t>(buffer_[0]) : big_endian(&buffer_[1], width));
+      buffer_.reserve(wanted);
+    }
+    if (buffer_.size() < wanted) {
+      expected_size = wanted - buffer_.size();
+      continue;
     }
-    unpacker.buffer_consumed(static_cast<std::size_t>(input_size));
 
-    if (unpacker.next(result)) {
-      if (result.get().type == msgpack::v2::type::POSITIVE_INTEGER) {
-        // we got a payload size hint! Use that to read the whole payload in one big chunk...
-        // and deal with the EXT issue when read in multiple chunks
-        expected_size = result.get().via.u64;
-        if(!unpacker.next(result)) {
-          continue;
-        }
+    auto end = start;
+    if (skip_value(buffer_.data(), buffer_.size(), end)) {
+      break;
+    }
+  }
+  in_ = buffer_.size();
+  payload_ = buffer_.data();
+  payload_size_ = buffer_.size();
+  load(start, input_required);
+  return false;
+}
+
+void script_data::read_from(const char *data, std::size_t size, bool input_required) {
+  if (size > 0 && data[0] == HEADER_MAGIC[0]) {
+    if (size < HEADER_SIZE || size - HEADER_SIZE != big_endian(data + 8, 8)) {
+      throw fatal_error(status_code::bad_input);
+    }
+    in_ = size;
+    payload_ = data;
+    payload_size_ = size;
+    load_sections(input_required);
+    return;
+  }
+
+  std::size_t start = 0;
+  if (size > 0 && size_hint_p(data[0])) {
+    start = 1 + size_hint_width(static_cast<std::uint8_t>(data[0]));
+  }
+
+  auto end = start;
+  if (start > size || !skip_value(data, size, end)) {
+    throw fatal_error(status_code::bad_input);
+  }
+  in_ = size;
+  payload_ = data;
+  payload_size_ = size;
+  load(start, input_required);
+}
+
+bool script_data::read_framed_from(int fd) {
+  std::uint8_t marker;
+  if (!read_fully(fd, reinterpret_cast<char *>(&marker), 1)) {
+    return false;
+  }
+  if (static_cast<char>(marker) == HEADER_MAGIC[0]) {
+    buffer_.assign(1, HEADER_MAGIC[0]);
+    read_header(fd);
+    read_rest_from(fd, true, nullptr);
+    return true;
+  }
+  if (!size_hint_p(static_cast<char>(marker))) {
+    throw fatal_error(status_code::bad_input); // not a positive integer
+  }
+
+  auto width = size_hint_width(marker);
+  char raw[8];
+  if (width > 0 && !read_fully(fd, raw, width)) {
+    throw fatal_error(status_code::bad_input);
+  }
+  std::uint64_t expected_size = width == 0 ? marker : big_endian(raw, width);
+  if (expected_size > MAX_PAYLOAD_SIZE) {
+    throw fatal_error(status_code::bad_input); // more than the heap has left
+  }
+
+  buffer_.resize(expected_size);
+  if (!read_fully(fd, buffer_.data(), expected_size)) {
+    throw fatal_error(status_code::bad_input);
+  }
+  in_ = 1 + width + expected_size;
+
+  std::size_t end = 0;
+  if (!skip_value(buffer_.data(), buffer_.size(), end)) {
+    throw fatal_error(status_code::bad_input);
+  }
+  payload_ = buffer_.data();
+  payload_size_ = buffer_.size();
+  load(0);
+  return true;
+}
+
+void script_data::read_header(int fd) {
+  // what was read of the header is already in buffer_
+  auto used = buffer_.size();
+  buffer_.resize(HEADER_SIZE);
+  if (!read_fully(fd, &buffer_[used], HEADER_SIZE - used)) {
+    throw fatal_error(status_code::bad_input);
+  }
+  if (std::memcmp(buffer_.data(), HEADER_MAGIC, sizeof(HEADER_MAGIC)) != 0 || buffer_[4] != HEADER_VERSION) {
+    throw fatal_error(status_code::bad_input);
+  }
+
+  // everything the header says is checked before the body is allocated
+  auto body_size = big_endian(&buffer_[8], 8);
+  if (body_size > MAX_PAYLOAD_SIZE - HEADER_SIZE) {
+    throw fatal_error(status_code::bad_input);
+  }
+  payload_ = buffer_.data();
+  payload_size_ = HEADER_SIZE + body_size;
+  std::size_t start, end;
+  for (std::size_t i = 0; i < SECTION_COUNT; ++i) {
+    section_bounds(i, start, end);
+  }
+
+  buffer_.resize(payload_size_);
+  in_ = buffer_.size();
+  payload_ = buffer_.data();
+}
+
+void script_data::read_rest_from(int fd, bool input_required, const std::function<void()> &sources_read) {
+  // When the input comes last, everything before it is loaded first, so
+  // that the sources can be compiled while the input is still on its way.
+  auto head = payload_size_;
+  std::size_t start, end;
+  if (sources_read && section_bounds(INPUT_SECTION, start, end) && end == payload_size_) {
+    head = start;
+    for (std::size_t i = SOURCES_SECTION; i < SECTION_COUNT; ++i) {
+      if (section_bounds(i, start, end) && end > head) {
+        head = payload_size_;
       }
-      this->input_ = find_in(result.get(), "input");
-      sources = find_in(result.get(), "sources");
-      if (this->input_.is_nil() || sources.is_nil()) {
+    }
+  }
+
+  if (!read_fully(fd, &buffer_[HEADER_SIZE], head - HEADER_SIZE)) {
+    throw fatal_error(status_code::bad_input);
+  }
+  auto batch = load_head();
+  if (head < payload_size_) {
+    sources_read();
+    if (!read_fully(fd, &buffer_[head], payload_size_ - head)) {
+      throw fatal_error(status_code::bad_input);
+    }
+  }
+  load_input(batch, input_required);
+}
+
+void script_data::load(std::size_t offset, bool input_required) {
+  // Only sources and library are unpacked to msgpack objects here; inputs
+  // are left as offsets into the buffer, to be decoded straight to mruby
+  // values by input().
+  zone_.clear();
+
+  std::uint32_t entries = 0;
+  if (!container_header(payload_, offset, true, entries)) {
+    throw fatal_error(status_code::bad_input);
+  }
+
+  msgpack::object sources, library;
+  auto input = NO_VALUE, inputs = NO_VALUE;
+  auto lazy = false;
+  tabulate_symbols_ = false;
+  dedup_strings_ = false;
+  for (std::uint32_t i = 0; i < entries; ++i) {
+    auto key = msgpack::v2::unpack(zone_, payload_, payload_size_, offset, reference_payload);
+    if (equal_to_symbol_p(key, "input")) {
+      input = offset;
+      skip_value(payload_, payload_size_, offset);
+    } else if (equal_to_symbol_p(key, "inputs")) {
+      inputs = offset;
+      skip_value(payload_, payload_size_, offset);
+    } else if (equal_to_symbol_p(key, "sources")) {
+      sources = msgpack::v2::unpack(zone_, payload_, payload_size_, offset, reference_payload);
+    } else if (equal_to_symbol_p(key, "lazy_input")) {
+      lazy = payload_[offset] == '\xc3'; // true
+      skip_value(payload_, payload_size_, offset);
+    } else if (equal_to_symbol_p(key, "symbol_table")) {
+      tabulate_symbols_ = payload_[offset] == '\xc3';
+      skip_value(payload_, payload_size_, offset);
+    } else if (equal_to_symbol_p(key, "dedup_strings")) {
+      dedup_strings_ = payload_[offset] == '\xc3';
+      skip_value(payload_, payload_size_, offset);
+    } else if (equal_to_symbol_p(key, "library")) {
+      library = msgpack::v2::unpack(zone_, payload_, payload_size_, offset, reference_payload);
+    } else {
+      skip_value(payload_, payload_size_, offset);
+    }
+  }
+
+  lazy_ = lazy;
+  index_code(sources, library);
+  index_input(input, inputs, input_required);
+}
+
+void script_data::load_sections(bool input_required) {
+  if (std::memcmp(payload_, HEADER_MAGIC, sizeof(HEADER_MAGIC)) != 0 || payload_[4] != HEADER_VERSION) {
+    throw fatal_error(status_code::bad_input);
+  }
+  auto batch = load_head();
+  load_input(batch, input_required);
+}
+
+bool script_data::load_head() {
+  // Same as load(), each section holding what would be under its key; in
+  // options, `batch` tells that the input section holds `inputs`.
+  zone_.clear();
+
+  std::size_t sections[SECTION_COUNT];
+  for (std::size_t i = SOURCES_SECTION; i < SECTION_COUNT; ++i) {
+    std::size_t start, end;
+    sections[i] = NO_VALUE;
+    if (section_bounds(i, start, end)) {
+      // exactly one value, validated on its own
+      auto offset = start;
+      if (!skip_value(payload_, end, offset) || offset != end) {
         throw fatal_error(status_code::bad_input);
       }
-      library = find_in(result.get(), "library");
-      break;
+      sections[i] = start;
+    }
+  }
+
+  auto batch = false;
+  lazy_ = false;
+  tabulate_symbols_ = false;
+  dedup_strings_ = false;
+  auto offset = sections[OPTIONS_SECTION];
+  if (offset != NO_VALUE) {
+    std::uint32_t entries = 0;
+    if (!container_header(payload_, offset, true, entries)) {
+      throw fatal_error(status_code::bad_input);
+    }
+    for (std::uint32_t i = 0; i < entries; ++i) {
+      auto key = msgpack::v2::unpack(zone_, payload_, payload_size_, offset, reference_payload);
+      if (equal_to_symbol_p(key, "lazy_input")) {
+        lazy_ = payload_[offset] == '\xc3';
+      } else if (equal_to_symbol_p(key, "batch")) {
+        batch = payload_[offset] == '\xc3';
+      } else if (equal_to_symbol_p(key, "symbol_table")) {
+        tabulate_symbols_ = payload_[offset] == '\xc3';
+      } else if (equal_to_symbol_p(key, "dedup_strings")) {
+        dedup_strings_ = payload_[offset] == '\xc3';
+      }
+      skip_value(payload_, payload_size_, offset);
+    }
+  }
+
+  msgpack::object sources, library;
+  if ((offset = sections[SOURCES_SECTION]) != NO_VALUE) {
+    sources = msgpack::v2::unpack(zone_, payload_, payload_size_, offset, reference_payload);
+  }
+  if ((offset = sections[LIBRARY_SECTION]) != NO_VALUE) {
+    library = msgpack::v2::unpack(zone_, payload_, payload_size_, offset, reference_payload);
+  }
+  index_code(sources, library);
+  return batch;
+}
+
+void script_data::load_input(bool batch, bool input_required) {
+  std::size_t start, end;
+  auto input = NO_VALUE;
+  if (section_bounds(INPUT_SECTION, start, end)) {
+    auto offset = start;
+    if (!skip_value(payload_, end, offset) || offset != end) {
+      throw fatal_error(status_code::bad_input);
     }
+    input = start;
+  }
+  index_input(batch ? NO_VALUE : input, batch ? input : NO_VALUE, input_required);
+}
+
+bool script_data::section_bounds(std::size_t section, std::size_t &start, std::size_t &end) const {
+  auto entry = payload_ + SECTION_TABLE + section * 16;
+  auto offset = big_endian(entry, 8), size = big_endian(entry + 8, 8);
+  auto body_size = payload_size_ - HEADER_SIZE;
+  if (offset > body_size || size > body_size - offset) {
+    throw fatal_error(status_code::bad_input);
+  }
+  start = HEADER_SIZE + offset;
+  end = start + size;
+  return size > 0;
+}
+
+void script_data::index_code(const msgpack::object &sources, const msgpack::object &library) {
+  if (sources.is_nil()) {
+    throw fatal_error(status_code::bad_input);
   }
   this->sources_ = unpack_sources(sources);
-  if (!library.is_nil()) {
-    this->library_ = fetch_library(library);
+  this->library_ = library.is_nil() ? byte_range{nullptr, 0} : fetch_library(library);
+}
+
+void script_data::index_input(std::size_t input, std::size_t inputs, bool input_required) {
+  input_ = input != NO_VALUE && payload_[input] != '\xc0' ? input : NO_VALUE;
+  inputs_.clear();
+  batch_ = false;
+
+  if (inputs != NO_VALUE && payload_[inputs] != '\xc0') {
+    std::uint32_t count = 0;
+    if (!container_header(payload_, inputs, false, count)) {
+      throw fatal_error(status_code::bad_input);
+    }
+    batch_ = true;
+    inputs_.reserve(count); // one allocation, even once sandboxed
+    for (std::uint32_t i = 0; i < count; ++i) {
+      inputs_.push_back(inputs);
+      skip_value(payload_, payload_size_, inputs);
+    }
+  }
+  if (input_required && input_ == NO_VALUE && !batch_) {
+    throw fatal_error(status_code::bad_input);
   }
 }
 
@@ -70,12 +401,42 @@ const std::vector<ruby_source> &script_data::sources() const {
   return sources_;
 }
 
-const std::vector<uint8_t> &script_data::library() const {
+byte_range script_data::library() const {
   return library_;
 }
 
 const mrb_value script_data::input(me_mruby_engine &engine) const {
-  return msgpack_to_ruby(engine, input_);
+  if (input_ == NO_VALUE) {
+    return mrb_nil_value();
+  }
+  return value_at(engine, input_);
+}
+
+bool script_data::tabulate_symbols() const {
+  return tabulate_symbols_;
+}
+
+bool script_data::dedup_strings() const {
+  return dedup_strings_;
+}
+
+bool script_data::batch() const {
+  return batch_;
+}
+
+std::size_t script_data::batch_size() const {
+  return inputs_.size();
+}
+
+const mrb_value script_data::input(me_mruby_engine &engine, std::size_t item) const {
+  return value_at(engine, inputs_[item]);
+}
+
+mrb_value script_data::value_at(me_mruby_engine &engine, std::size_t offset) const {
+  if (lazy_) {
+    return lazy_value(engine, payload_, payload_size_, offset, 0);
+  }
+  return decode(engine, payload_, payload_size_, offset, dedup_strings_);
 }
 
 void script_data::sources(const std::vector<ruby_source> &sources) {
@@ -88,20 +449,25 @@ std::uint64_t script_data::size() {
 
 // HELPERS
 
-msgpack::object find_in(const msgpack::object &object, const char *key) {
-  msgpack::object nil;
-  if (object.type == msgpack::type::MAP) {
-    for (auto &element : object.via.map) {
-      if (equal_to_symbol_p(element.key, key)) {
-        return element.val;
+bool read_fully(int fd, char *buffer, std::size_t size) {
+  std::size_t done = 0;
+  while (done < size) {
+    auto read_size = read(fd, buffer + done, size - done);
+    if (read_size == -1) {
+      if (errno == EINTR) continue;
+      throw fatal_error(status_code::io_failure);
+    }
+    if (read_size == 0) {
+      if (done == 0) {
+        return false;
       }
+      throw fatal_error(status_code::bad_input); // truncated
     }
+    done += read_size;
   }
-
-  return nil;
+  return true;
 }
 
-
 bool equal_to_symbol_p(const msgpack::object &object, const std::string &string) {
   if (object.type != msgpack::type::EXT) {
     return false;
@@ -127,104 +493,485 @@ std::vector<ruby_source> unpack_sources(const msgpack::object &object) {
     }
 
     auto path = element.via.array.ptr[0], source = element.via.array.ptr[1];
-    if (path.type != msgpack::type::STR || source.type != msgpack::type::STR) {
+    if (path.type != msgpack::type::STR) {
       throw fatal_error(status_code::bad_input);
     }
 
-    sources.emplace_back(ruby_source{path.as<std::string>(), source.as<std::string>()});
+    if (source.type == msgpack::type::STR) {
+      sources.emplace_back(ruby_source{path.as<std::string>(), source.as<std::string>()});
+    } else if (source.type == msgpack::type::BIN) {
+      // precompiled, see script_runner::compile
+      std::string bytecode{source.via.bin.ptr, source.via.bin.size};
+      sources.emplace_back(ruby_source{path.as<std::string>(), bytecode, true});
+    } else {
+      throw fatal_error(status_code::bad_input);
+    }
   }
   return sources;
 }
 
-std::vector<std::uint8_t> fetch_library(const msgpack::object &object) {
+byte_range fetch_library(const msgpack::object &object) {
   if (object.type != msgpack::type::BIN) {
     throw fatal_error(status_code::bad_input);
   }
-  return object.as<std::vector<std::uint8_t>>();
+  return byte_range{reinterpret_cast<const std::uint8_t *>(object.via.bin.ptr), object.via.bin.size};
 }
 
-void check_depth(int current_depth) {
-  if (current_depth > 32) {
-    throw fatal_error(status_code::structure_too_deep);
+bool reference_payload(msgpack::type::object_type, std::size_t, void *) {
+  // strings, binaries and exts point into the unpacker's buffer instead of
+  // being copied to its zone; the result handle keeps that buffer alive
+  return true;
+}
+
+bool size_hint_p(char marker) {
+  auto byte = static_cast<std::uint8_t>(marker);
+  return byte < 0x80 || (byte >= 0xcc && byte <= 0xcf); // a positive integer
+}
+
+std::size_t size_hint_width(std::uint8_t marker) {
+  switch (marker) {
+    case 0xcc: return 1;
+    case 0xcd: return 2;
+    case 0xce: return 4;
+    case 0xcf: return 8;
+    default: return 0; // positive fixint
+  }
+}
+
+std::uint64_t big_endian(const char *bytes, std::size_t width) {
+  std::uint64_t value = 0;
+  for (std::size_t i = 0; i < width; ++i) {
+    value = (value << 8) | static_cast<std::uint8_t>(bytes[i]);
   }
+  return value;
 }
 
-static bool integer_p(const msgpack::object &msgpack_value) {
-  auto type = msgpack_value.type;
-  return
-      type == msgpack::type::POSITIVE_INTEGER ||
-      type == msgpack::type::NEGATIVE_INTEGER;
+// Walks a msgpack value without building anything from it.
+struct value_skipper : msgpack::v2::null_visitor {
+  bool incomplete = false;
+
+  void insufficient_bytes(std::size_t, std::size_t) {
+    incomplete = true;
+  }
+};
+
+bool skip_value(const char *data, std::size_t size, std::size_t &offset) {
+  value_skipper skipper;
+  if (msgpack::v2::parse(data, size, offset, skipper)) {
+    return true;
+  }
+  if (!skipper.incomplete) {
+    throw fatal_error(status_code::bad_input);
+  }
+  return false;
 }
 
-static bool float_p(const msgpack::object &msgpack_value) {
-  auto type = msgpack_value.type;
-  return type == msgpack::type::FLOAT;
+bool container_header(const char *data, std::size_t &offset, bool map, std::uint32_t &size) {
+  auto marker = static_cast<std::uint8_t>(data[offset]);
+  std::uint8_t fixed = map ? 0x80 : 0x90, wide = map ? 0xde : 0xdc;
+  if ((marker & 0xf0) == fixed) {
+    size = marker & 0x0f;
+    offset += 1;
+    return true;
+  }
+
+  std::size_t width;
+  if (marker == wide) {
+    width = 2;
+  } else if (marker == wide + 1) {
+    width = 4;
+  } else {
+    return false;
+  }
+  size = static_cast<std::uint32_t>(big_endian(data + offset + 1, width));
+  offset += 1 + width;
+  return true;
 }
 
-mrb_value msgpack_to_ruby(me_mruby_engine &engine, const msgpack::object &msgpack_value, int depth) {
-  check_depth(depth);
+void check_depth(int current_depth) {
+  if (current_depth > MAX_DEPTH) {
+    throw fatal_error(status_code::structure_too_deep);
+  }
+}
 
-  if (msgpack_value.type == msgpack::type::NIL) {
-    return mrb_nil_value();
-  } else if (msgpack_value.type == msgpack::type::BOOLEAN) {
-    if (msgpack_value.as<bool>()) {
-      auto value = mrb_true_value();
-      engine.check_exception();
-      return value;
-    } else {
-      auto value = mrb_false_value();
-      engine.check_exception();
-      return value;
+// Builds mruby values while msgpack bytes are being parsed, arrays and
+// hashes being sized from their header.
+class ruby_value_builder : public msgpack::v2::null_visitor {
+public:
+  ruby_value_builder(me_mruby_engine &engine, bool dedup_strings)
+      : engine_(engine), dedup_strings_(dedup_strings), value_(mrb_nil_value()), depth_(0) {}
+
+  mrb_value value() const {
+    return value_;
+  }
+
+  bool visit_nil() {
+    return add(mrb_nil_value());
+  }
+
+  bool visit_boolean(bool value) {
+    return add(value ? mrb_true_value() : mrb_false_value());
+  }
+
+  bool visit_positive_integer(std::uint64_t value) {
+    if (value > static_cast<std::uint64_t>(MRB_INT_MAX)) {
+      throw fatal_error(status_code::overflow);
     }
-  } else if (integer_p(msgpack_value)) {
-    return mrb_fixnum_value(mrb_int{msgpack_value.as<long>()});
-  } else if (float_p(msgpack_value)) {
-    auto ruby_value = mrb_float_value(engine.state, mrb_float{msgpack_value.as<double>()});
-    engine.check_exception();
-    return ruby_value;
-  } else if (msgpack_value.type == msgpack::type::STR) {
-    auto string_value = msgpack_value.as<std::string>();
-    auto ruby_value = mrb_str_new(engine.state, string_value.data(), string_value.size());
-    engine.check_exception();
-    return ruby_value;
-  } else if (msgpack_value.type == msgpack::type::BIN) {
-    auto string_value = msgpack_value.as<std::vector<char>>();
-    auto ruby_value = mrb_str_new(engine.state, string_value.data(), string_value.size());
-    engine.check_exception();
+    return add(mrb_fixnum_value(static_cast<mrb_int>(value)));
+  }
+
+  bool visit_negative_integer(std::int64_t value) {
+    if (value < MRB_INT_MIN) {
+      throw fatal_error(status_code::overflow);
+    }
+    return add(mrb_fixnum_value(static_cast<mrb_int>(value)));
+  }
+
+  bool visit_float32(float value) {
+    return visit_float64(value);
+  }
+
+  bool visit_float64(double value) {
+    auto ruby_value = mrb_float_value(engine_.state, mrb_float{value});
+    engine_.check_exception();
+    return add(ruby_value);
+  }
+
+  bool visit_str(const char *data, std::uint32_t size) {
+    if (dedup_strings_ && size <= MAX_SHARED_STRING_SIZE) {
+      return add(shared_string(data, size));
+    }
+    auto ruby_value = mrb_str_new(engine_.state, data, size);
+    engine_.check_exception();
+    return add(ruby_value);
+  }
+
+  bool visit_bin(const char *data, std::uint32_t size) {
+    return visit_str(data, size);
+  }
+
+  bool visit_ext(const char *data, std::uint32_t size) {
+    // `data` starts with the ext type
+    auto type = static_cast<std::int8_t>(data[0]);
+    switch (type) {
+      case SYMBOL_EXT_CODE: {
+        auto symbol = mrb_intern(engine_.state, data + 1, size - 1);
+        engine_.check_exception();
+        return add(mrb_symbol_value(symbol));
+      }
+      case SYMBOL_DEFINITION_EXT_CODE: {
+        // interned once, however many times it is referred to
+        auto symbol = mrb_intern(engine_.state, data + 1, size - 1);
+        engine_.check_exception();
+        symbols_.push_back(symbol);
+        return add(mrb_symbol_value(symbol));
+      }
+      case SYMBOL_REFERENCE_EXT_CODE: {
+        auto width = size - 1;
+        if (width != 1 && width != 2 && width != 4) {
+          throw fatal_error(status_code::bad_symbol);
+        }
+        auto id = big_endian(data + 1, width);
+        if (id >= symbols_.size()) {
+          throw fatal_error(status_code::bad_symbol);
+        }
+        return add(mrb_symbol_value(symbols_[id]));
+      }
+      default:
+        throw unknown_ext{type};
+    }
+  }
+
+  bool start_array(std::uint32_t size) {
+    check_depth(depth_);
+    auto array = mrb_ary_new_capa(engine_.state, size);
+    engine_.check_exception();
+    return push(array, false);
+  }
+
+  bool end_array() {
+    return add(stack_[--depth_].container);
+  }
+
+  bool start_map(std::uint32_t size) {
+    check_depth(depth_);
+    auto hash = mrb_hash_new_capa(engine_.state, size);
+    engine_.check_exception();
+    return push(hash, true);
+  }
+
+  bool start_map_key() {
+    stack_[depth_ - 1].at_key = true;
+    return true;
+  }
+
+  bool start_map_value() {
+    stack_[depth_ - 1].at_key = false;
+    return true;
+  }
+
+  bool end_map() {
+    return add(stack_[--depth_].container);
+  }
+
+private:
+  struct frame {
+    mrb_value container;
+    mrb_value key;
+    bool map;
+    bool at_key;
+  };
+
+  // Frozen, so that the value can be shared by every occurrence.
+  mrb_value shared_string(const char *data, std::uint32_t size) {
+    std::string key{data, size};
+    auto found = strings_.find(key);
+    if (found != strings_.end()) {
+      engine_.deduplicated_bytes += size;
+      return found->second;
+    }
+
+    auto ruby_value = mrb_str_new(engine_.state, data, size);
+    engine_.check_exception();
+    MRB_SET_FROZEN_FLAG(mrb_basic_ptr(ruby_value));
+    strings_.emplace(std::move(key), ruby_value);
     return ruby_value;
-  } else if (msgpack_value.type == msgpack::type::ARRAY) {
-    auto array = mrb_ary_new(engine.state);
+  }
+
+  bool push(mrb_value container, bool map) {
+    stack_[depth_++] = frame{container, mrb_nil_value(), map, false};
+    return true;
+  }
+
+  // Values are added once complete, so that a container used as a hash key
+  // is hashed with its elements in.
+  bool add(mrb_value value) {
+    if (depth_ == 0) {
+      value_ = value;
+      return true;
+    }
+
+    check_depth(depth_);
+    auto &top = stack_[depth_ - 1];
+    if (!top.map) {
+      mrb_ary_push(engine_.state, top.container, value);
+    } else if (top.at_key) {
+      top.key = value;
+      return true;
+    } else {
+      mrb_hash_set(engine_.state, top.container, top.key, value);
+    }
+    engine_.check_exception();
+    return true;
+  }
+
+  me_mruby_engine &engine_;
+  bool dedup_strings_;
+  std::unordered_map<std::string, mrb_value> strings_;
+  std::vector<mrb_sym> symbols_; // defined so far, by id
+  mrb_value value_;
+  frame stack_[MAX_DEPTH + 1];
+  int depth_;
+};
+
+mrb_value decode(me_mruby_engine &engine, const char *data, std::size_t size, std::size_t &offset, bool dedup_strings) {
+  ruby_value_builder builder{engine, dedup_strings};
+  msgpack::v2::parse(data, size, offset, builder);
+  return builder.value();
+}
+
+// LAZY INPUT
+
+struct lazy_input {
+  const char *payload;
+  std::size_t size;
+  std::size_t offset;
+  int depth;
+};
+
+static const struct mrb_data_type lazy_input_type = {"LazyInput", mrb_free};
+static const char *LAZY_INPUT_VALUE = "__value";
+
+static bool container_p(char marker) {
+  auto byte = static_cast<std::uint8_t>(marker);
+  return (byte >= 0x80 && byte <= 0x9f) || (byte >= 0xdc && byte <= 0xdf);
+}
+
+// One level of the proxied container, with proxies for the containers in it.
+static mrb_value materialize(me_mruby_engine &engine, const lazy_input &input) {
+  auto offset = input.offset;
+  std::uint32_t count = 0;
+  if (container_header(input.payload, offset, true, count)) {
+    auto hash = mrb_hash_new_capa(engine.state, count);
     engine.check_exception();
-    for (auto &element : msgpack_value.via.array) {
-      mrb_ary_push(engine.state, array, msgpack_to_ruby(engine, element, depth + 1));
+    for (std::uint32_t i = 0; i < count; ++i) {
+      auto key = lazy_value(engine, input.payload, input.size, offset, input.depth + 1);
+      auto value = lazy_value(engine, input.payload, input.size, offset, input.depth + 1);
+      mrb_hash_set(engine.state, hash, key, value);
       engine.check_exception();
     }
-    return array;
-  } else if (msgpack_value.type == msgpack::type::MAP) {
-    auto hash = mrb_hash_new(engine.state);
+    return hash;
+  }
+
+  container_header(input.payload, offset, false, count);
+  auto array = mrb_ary_new_capa(engine.state, count);
+  engine.check_exception();
+  for (std::uint32_t i = 0; i < count; ++i) {
+    mrb_ary_push(engine.state, array, lazy_value(engine, input.payload, input.size, offset, input.depth + 1));
+    engine.check_exception();
+  }
+  return array;
+}
+
+// Runs `decoding` from the VM, through which nothing may be thrown: decoding
+// failures leave with their usual status, and an unknown ext raises.
+template <typename F>
+static mrb_value decode_in_vm(mrb_state *mrb, F decoding) {
+  auto value = mrb_nil_value();
+  auto code = status_code::ok;
+  auto undecodable = false;
+  try {
+    value = decoding();
+  } catch (fatal_error &e) {
+    code = e.get_err_code();
+  } catch (error_base &) {
+    undecodable = true;
+  }
+  if (code != status_code::ok) {
+    leave(code);
+  }
+  if (undecodable) {
+    mrb_raise(mrb, E_TYPE_ERROR, "can't decode input");
+  }
+  return value;
+}
+
+static mrb_value lazy_input_value(mrb_state *mrb, mrb_value self) {
+  auto memo = mrb_intern_cstr(mrb, LAZY_INPUT_VALUE);
+  auto value = mrb_iv_get(mrb, self, memo);
+  if (!mrb_nil_p(value)) {
+    return value;
+  }
+
+  auto input = static_cast<lazy_input *>(mrb_data_get_ptr(mrb, self, &lazy_input_type));
+  auto engine = reinterpret_cast<me_mruby_engine *>(mrb->allocf_ud);
+  value = decode_in_vm(mrb, [engine, input]() { return materialize(*engine, *input); });
+  mrb_iv_set(mrb, self, memo, value);
+  return value;
+}
+
+// A copy of `value` with no proxies left in it: what is still undecoded is
+// decoded as a whole, what was materialized is copied, with any changes.
+static mrb_value convert(me_mruby_engine &engine, mrb_value value, int depth) {
+  auto input = static_cast<lazy_input *>(mrb_data_check_get_ptr(engine.state, value, &lazy_input_type));
+  if (input == nullptr) {
+    return value;
+  }
+  check_depth(depth); // materialized containers can be made to hold themselves
+
+  auto materialized = mrb_iv_get(engine.state, value, mrb_intern_cstr(engine.state, LAZY_INPUT_VALUE));
+  if (mrb_nil_p(materialized)) {
+    auto offset = input->offset;
+    return decode(engine, input->payload, input->size, offset);
+  }
+
+  if (mrb_hash_p(materialized)) {
+    auto keys = mrb_hash_keys(engine.state, materialized);
+    auto hash = mrb_hash_new_capa(engine.state, RARRAY_LEN(keys));
     engine.check_exception();
-    for (auto &element : msgpack_value.via.map) {
-      mrb_hash_set(
-          engine.state,
-          hash,
-          msgpack_to_ruby(engine, element.key, depth + 1),
-          msgpack_to_ruby(engine, element.val, depth + 1));
+    for (auto i = mrb_int{0}; i < RARRAY_LEN(keys); ++i) {
+      auto key = RARRAY_PTR(keys)[i];
+      auto element = mrb_hash_get(engine.state, materialized, key);
+      mrb_hash_set(engine.state, hash, convert(engine, key, depth + 1), convert(engine, element, depth + 1));
       engine.check_exception();
     }
     return hash;
-  } else if (msgpack_value.type == msgpack::type::EXT) {
-    auto ext = msgpack_value.via.ext;
-    switch (ext.type()) {
-      case SYMBOL_EXT_CODE: {
-        auto symbol = mrb_intern(engine.state, ext.data(), ext.size);
-        engine.check_exception();
-        return mrb_symbol_value(symbol);
-      }
-      default:
-        throw unknown_ext{ext.type()};
-    }
-  } else {
-    throw unknown_type{msgpack_value.type};
   }
+
+  auto array = mrb_ary_new_capa(engine.state, RARRAY_LEN(materialized));
+  engine.check_exception();
+  for (auto i = mrb_int{0}; i < RARRAY_LEN(materialized); ++i) {
+    mrb_ary_push(engine.state, array, convert(engine, RARRAY_PTR(materialized)[i], depth + 1));
+    engine.check_exception();
+  }
+  return array;
+}
+
+// to_h and to_a, on a plain Hash or Array.
+static mrb_value lazy_input_convert(mrb_state *mrb, mrb_value self) {
+  mrb_value *argv;
+  mrb_int argc;
+  mrb_value block;
+  mrb_get_args(mrb, "*&", &argv, &argc, &block);
+  auto name = mrb->c->ci->mid;
+  auto engine = reinterpret_cast<me_mruby_engine *>(mrb->allocf_ud);
+  auto converted = decode_in_vm(mrb, [engine, self]() { return convert(*engine, self, 0); });
+  return mrb_funcall_with_block(mrb, converted, name, argc, argv, block);
+}
+
+static mrb_value lazy_input_delegate(mrb_state *mrb, mrb_value self) {
+  mrb_value *argv;
+  mrb_int argc;
+  mrb_value block;
+  mrb_get_args(mrb, "*&", &argv, &argc, &block);
+  auto name = mrb->c->ci->mid;
+  return mrb_funcall_with_block(mrb, lazy_input_value(mrb, self), name, argc, argv, block);
+}
+
+static mrb_value lazy_input_method_missing(mrb_state *mrb, mrb_value self) {
+  mrb_sym name;
+  mrb_value *argv;
+  mrb_int argc;
+  mrb_value block;
+  mrb_get_args(mrb, "n*&", &name, &argv, &argc, &block);
+  return mrb_funcall_with_block(mrb, lazy_input_value(mrb, self), name, argc, argv, block);
+}
+
+static struct RClass *lazy_input_class(mrb_state *mrb) {
+  if (mrb_class_defined(mrb, "LazyInput")) {
+    return mrb_class_get(mrb, "LazyInput");
+  }
+
+  auto klass = mrb_define_class(mrb, "LazyInput", mrb->object_class);
+  MRB_SET_INSTANCE_TT(klass, MRB_TT_DATA);
+  mrb_undef_class_method(mrb, klass, "new");
+  // A proxy is a LazyInput as far as class, is_a?, case and == go, whatever
+  // it holds; to_h and to_a give a plain Hash or Array for those.
+  static const char *delegated[] = {
+    "[]", "dig", "each", "size", "length", "to_s", "inspect", "respond_to?",
+  };
+  for (auto name : delegated) {
+    mrb_define_method(mrb, klass, name, lazy_input_delegate, MRB_ARGS_ANY());
+  }
+  mrb_define_method(mrb, klass, "to_h", lazy_input_convert, MRB_ARGS_ANY());
+  mrb_define_method(mrb, klass, "to_a", lazy_input_convert, MRB_ARGS_ANY());
+  mrb_define_method(mrb, klass, "method_missing", lazy_input_method_missing, MRB_ARGS_ANY());
+  return klass;
 }
 
+mrb_value lazy_value(me_mruby_engine &engine, const char *data, std::size_t size, std::size_t &offset, int depth) {
+  check_depth(depth);
+  if (!container_p(data[offset])) {
+    return decode(engine, data, size, offset);
+  }
+
+  auto klass = lazy_input_class(engine.state);
+  auto input = static_cast<lazy_input *>(mrb_malloc(engine.state, sizeof(lazy_input)));
+  *input = lazy_input{data, size, offset, depth};
+  auto proxy = mrb_obj_value(mrb_data_object_alloc(engine.state, klass, input, &lazy_input_type));
+  skip_value(data, size, offset);
+  return proxy;
+}
+
+bool lazy_input_p(me_mruby_engine &engine, mrb_value value, mrb_value &materialized, byte_range &bytes) {
+  auto input = static_cast<lazy_input *>(mrb_data_check_get_ptr(engine.state, value, &lazy_input_type));
+  if (input == nullptr) {
+    return false;
+  }
+
+  materialized = mrb_iv_get(engine.state, value, mrb_intern_cstr(engine.state, LAZY_INPUT_VALUE));
+  auto end = input->offset;
+  skip_value(input->payload, input->size, end);
+  bytes = byte_range{reinterpret_cast<const std::uint8_t *>(input->payload + input->offset), end - input->offset};
+  return true;
+}
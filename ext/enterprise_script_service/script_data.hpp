@@ -5,23 +5,83 @@
 #ifndef ENTERPRISE_SCRIPT_SERVICE_SCRIPT_DATA_HPP
 #define ENTERPRISE_SCRIPT_SERVICE_SCRIPT_DATA_HPP
 
+#include <cstdint>
+#include <functional>
 #include <msgpack.hpp>
 #include "mruby_engine.hpp"
 
+// Bytes within the payload a script_data read, valid as long as it is.
+struct byte_range {
+  const std::uint8_t *data;
+  std::size_t length;
+
+  std::size_t size() const { return length; }
+  std::uint8_t operator[](std::size_t i) const { return data[i]; }
+};
+
+// With lazy input, @input and the containers in it are proxies, each decoding
+// one level of the payload on first use. For such a proxy, sets either
+// `materialized` to what it decoded to, or else `bytes` to its msgpack.
+bool lazy_input_p(me_mruby_engine &engine, mrb_value value, mrb_value &materialized, byte_range &bytes);
+
 class script_data {
 public:
-  void read_from(int fd);
+  // Reads either a msgpack payload, optionally preceded by its size, or a
+  // sectioned one starting with a fixed-size header giving the size and
+  // location of each of its parts. If that one's input comes last,
+  // `sources_read` is called once the rest is loaded, before the input is
+  // read, e.g. to compile the sources in the meantime.
+  void read_from(int fd, bool input_required = true, const std::function<void()> &sources_read = nullptr);
+  // The same in two steps, read_start_from returning whether read_rest_from
+  // is needed; it is when it read the header of a sectioned payload, having
+  // allocated the memory the rest is read to. From sources_read on, only a
+  // batch's index of its inputs is allocated, sized from its array header
+  // and out of the heap set aside by reserve_memory, so it can be where the
+  // process sandboxes itself.
+  bool read_start_from(int fd, bool input_required = true);
+  void read_rest_from(int fd, bool input_required = true, const std::function<void()> &sources_read = nullptr);
+  // Reads a payload in place, e.g. from shared memory; it must outlive this.
+  void read_from(const char *data, std::size_t size, bool input_required = true);
+  // Reads exactly one size-prefixed payload, leaving whatever follows it in
+  // `fd` untouched. Returns false on end of input before the first byte.
+  bool read_framed_from(int fd);
   const std::vector<ruby_source> &sources() const;
-  const std::vector<uint8_t> &library() const;
+  byte_range library() const;
   const mrb_value input(me_mruby_engine &engine) const;
+  // A batch payload has `inputs`, the sources being run once for each.
+  bool batch() const;
+  std::size_t batch_size() const;
+  const mrb_value input(me_mruby_engine &engine, std::size_t item) const;
+  // Whether the client asked for output using the symbol table extension.
+  bool tabulate_symbols() const;
+  // Whether short input strings are decoded to one frozen string per value.
+  bool dedup_strings() const;
   void sources(const std::vector<ruby_source> &sources);
   std::uint64_t size();
 
 private:
-  msgpack::object input_;
+  void read_header(int fd);
+  void load(std::size_t offset, bool input_required = true);
+  void load_sections(bool input_required);
+  bool load_head();
+  void load_input(bool batch, bool input_required);
+  bool section_bounds(std::size_t section, std::size_t &start, std::size_t &end) const;
+  void index_code(const msgpack::object &sources, const msgpack::object &library);
+  void index_input(std::size_t input, std::size_t inputs, bool input_required);
+  mrb_value value_at(me_mruby_engine &engine, std::size_t offset) const;
+
+  std::vector<char> buffer_;
+  const char *payload_ = nullptr; // in buffer_, unless read in place
+  std::size_t payload_size_ = 0;
+  msgpack::zone zone_;
+  std::size_t input_ = SIZE_MAX; // offset in the payload, if any
+  std::vector<std::size_t> inputs_;
+  bool batch_ = false;
+  bool lazy_ = false;
+  bool tabulate_symbols_ = false;
+  bool dedup_strings_ = false;
   std::vector<ruby_source> sources_;
-  std::vector<uint8_t> library_;
-  msgpack::object_handle result;
+  byte_range library_ = {nullptr, 0};
   std::uint64_t in_;
 };
 
@@ -4,16 +4,62 @@
 
 #include "script_runner.hpp"
 #include "error.hpp"
+#include "profiler.hpp"
 #include <mruby/proc.h>
 
-script_runner::script_runner(me_mruby_engine &engine, timer &timer)
-    : engine_(engine), timer_(timer) { }
+script_runner::script_runner(me_mruby_engine &engine, timer &timer, code_cache *cache)
+    : engine_(engine), timer_(timer), cache_(cache) { }
+
+script_runner::~script_runner() {
+  for (auto proc : prepared_) {
+    if (proc != nullptr) {
+      mrb_gc_unregister(engine_.state, mrb_obj_value(proc));
+    }
+  }
+  if (library_ != nullptr) {
+    mrb_gc_unregister(engine_.state, mrb_obj_value(library_));
+  }
+}
+
+void script_runner::prepare(script_data &script) {
+  {
+    auto timing = timer_.measure("lib");
+    auto data = script.library();
+    if (data.size() > 0) {
+      library_ = engine_.read_instruction_sequence(data.data, data.size());
+      mrb_gc_register(engine_.state, mrb_obj_value(library_));
+    }
+  }
+
+  for (auto &&source : script.sources()) {
+    auto timing = timer_.measure("compile");
+    try {
+      auto proc = cache_ ? cache_->generate_code(engine_, source) : engine_.generate_code(source);
+      mrb_gc_register(engine_.state, mrb_obj_value(proc));
+      prepared_.push_back(proc);
+    } catch (error_base &) {
+      prepared_.push_back(nullptr);
+    }
+  }
+}
+
+struct RProc *script_runner::generate_code(std::size_t index, const ruby_source &source) {
+  if (index < prepared_.size() && prepared_[index] != nullptr) {
+    return prepared_[index];
+  }
+  return cache_ ? cache_->generate_code(engine_, source) : engine_.generate_code(source);
+}
 
 bool script_runner::run(script_data &script, data_writer &writer, unsigned int instruction_quota_start) {
+  if (script.batch()) {
+    return run_batch(script, writer, instruction_quota_start);
+  }
+
   auto success = true;
-  mruby_data_writer engine_writer(writer, engine_, script.size());
+  mruby_data_writer engine_writer(
+    writer, engine_, script.size(), cache_, script.tabulate_symbols(), script.dedup_strings());
   try {
-    engine_.limit_instructions = !instruction_quota_start;
+    engine_.limit_instructions(!instruction_quota_start);
     mrb_value value;
     {
       auto timing = timer_.measure("decode");
@@ -26,22 +72,27 @@ bool script_runner::run(script_data &script, data_writer &writer, unsigned int i
 
     {
       auto timing = timer_.measure("lib");
-      auto &data = script.library();
-      if (data.size() > 0) {
-        engine_.load_instruction_sequence(data);
+      auto data = script.library();
+      if (library_ != nullptr) {
+        engine_.eval(library_);
+      } else if (data.size() > 0) {
+        engine_.load_instruction_sequence(data.data, data.size());
       }
     }
 
     unsigned int index = 0;
     for (auto &&source : script.sources()) {
-      if (++index > instruction_quota_start && !engine_.limit_instructions) {
-        engine_.limit_instructions = true;
+      if (++index > instruction_quota_start) {
+        engine_.limit_instructions(true);
+      }
+      if (engine_.profile != nullptr) {
+        engine_.profile->enter_source(index - 1);
       }
       try {
         RProc *pProc;
         {
           auto timing = timer_.measure("compile");
-          pProc = engine_.generate_code(source);
+          pProc = generate_code(index - 1, source);
         }
 
         {
@@ -60,11 +111,131 @@ bool script_runner::run(script_data &script, data_writer &writer, unsigned int i
       engine_writer.emit_output();
     }
   } catch (error_base &err) {
-    engine_.limit_instructions = true;
+    engine_.limit_instructions(true);
     err.pack_into(writer.packer);
     return false;
   }
 
-  engine_.limit_instructions = true;
+  engine_.limit_instructions(true);
+  return success;
+}
+
+bool script_runner::run_batch(script_data &script, data_writer &writer, unsigned int instruction_quota_start) {
+  std::vector<RProc *> procs;
+  try {
+    engine_.limit_instructions(!instruction_quota_start);
+    {
+      auto timing = timer_.measure("lib");
+      auto data = script.library();
+      if (library_ != nullptr) {
+        engine_.eval(library_);
+      } else if (data.size() > 0) {
+        engine_.load_instruction_sequence(data.data, data.size());
+      }
+    }
+
+    for (auto &&source : script.sources()) {
+      auto timing = timer_.measure("compile");
+      auto proc = generate_code(procs.size(), source);
+      mrb_gc_register(engine_.state, mrb_obj_value(proc));
+      procs.push_back(proc);
+    }
+  } catch (error_base &err) {
+    engine_.limit_instructions(true);
+    err.pack_into(writer.packer);
+    return false;
+  }
+
+  auto success = true;
+  for (std::size_t item = 0; item < script.batch_size(); ++item) {
+    writer.emit_item(item);
+    auto arena = mrb_gc_arena_save(engine_.state);
+    success = run_item(script, item, procs, writer, instruction_quota_start) && success;
+    mrb_gc_arena_restore(engine_.state, arena);
+  }
+
+  for (auto proc : procs) {
+    mrb_gc_unregister(engine_.state, mrb_obj_value(proc));
+  }
+  engine_.limit_instructions(true);
+  return success;
+}
+
+bool script_runner::run_item(
+  script_data &script,
+  std::size_t item,
+  const std::vector<RProc *> &procs,
+  data_writer &writer,
+  unsigned int instruction_quota_start)
+{
+  auto success = true;
+  engine_.reset_instruction_count();
+  engine_.execution_time_us = 0;
+  engine_.deduplicated_bytes = 0;
+  me_mruby_engine_reset_gc_stats(&engine_);
+  engine_.limit_instructions(!instruction_quota_start);
+  if (engine_.profile != nullptr) {
+    engine_.profile->enter_setup(); // decoding the item's input
+  }
+  mruby_data_writer engine_writer(
+    writer, engine_, script.size(), cache_, script.tabulate_symbols(), script.dedup_strings());
+  try {
+    mrb_value value;
+    {
+      auto timing = timer_.measure("decode");
+      value = script.input(engine_, item);
+    }
+    {
+      auto timing = timer_.measure("inject");
+      auto nil = mrb_nil_value();
+      engine_.inject("@output", nil);
+      engine_.inject("@stdout_buffer", nil);
+      engine_.inject("@input", value);
+    }
+
+    unsigned int index = 0;
+    for (auto proc : procs) {
+      if (++index > instruction_quota_start) {
+        engine_.limit_instructions(true);
+      }
+      if (engine_.profile != nullptr) {
+        engine_.profile->enter_source(index - 1);
+      }
+      try {
+        auto timing = timer_.measure("eval");
+        engine_.eval(proc);
+        engine_.execution_time_us = timing.get_elapsed_time_us();
+      } catch (error_base &err) {
+        success = false;
+        err.pack_into(writer.packer);
+      }
+    }
+
+    {
+      auto timing = timer_.measure("out");
+      engine_writer.emit_output();
+    }
+  } catch (error_base &err) {
+    err.pack_into(writer.packer);
+    return false;
+  }
+  return success;
+}
+
+bool script_runner::compile(script_data &script, data_writer &writer) {
+  auto success = true;
+  for (auto &&source : script.sources()) {
+    try {
+      std::vector<std::uint8_t> bytecode;
+      {
+        auto timing = timer_.measure("compile");
+        bytecode = engine_.dump_instruction_sequence(engine_.generate_code(source));
+      }
+      writer.emit_compiled(source.path, bytecode);
+    } catch (error_base &err) {
+      success = false;
+      err.pack_into(writer.packer);
+    }
+  }
   return success;
 }
@@ -6,6 +6,7 @@
 #define ENTERPRISE_SCRIPT_SERVICE_SCRIPT_RUNNER_HPP
 
 
+#include "code_cache.hpp"
 #include "mruby_engine.hpp"
 #include "script_data.hpp"
 #include "timer.hpp"
@@ -13,25 +14,51 @@
 
 class script_runner {
 public:
-  script_runner(me_mruby_engine &engine, timer &timer);
+  script_runner(me_mruby_engine &engine, timer &timer, code_cache *cache = nullptr);
+  ~script_runner();
+  // Compiles the sources and reads the library ahead of run, e.g. while the
+  // input is still coming in. Sources that fail to compile are left for run
+  // to report, in their turn.
+  void prepare(script_data &script);
   bool run(script_data &script, data_writer &writer, unsigned int instruction_quota_start = 0);
+  bool compile(script_data &script, data_writer &writer);
 
 private:
+  struct RProc *generate_code(std::size_t index, const ruby_source &source);
+  bool run_batch(script_data &script, data_writer &writer, unsigned int instruction_quota_start);
+  bool run_item(script_data &script, std::size_t item, const std::vector<RProc *> &procs, data_writer &writer, unsigned int instruction_quota_start);
+
   me_mruby_engine &engine_;
   timer &timer_;
+  code_cache *cache_;
+  std::vector<struct RProc *> prepared_;
+  struct RProc *library_ = nullptr;
 };
 
 class mruby_data_writer {
 public:
-  mruby_data_writer(data_writer &writer, me_mruby_engine &engine, std::uint64_t in = 0);
+  // With `tabulate_symbols`, output and chunks use the symbol table extension;
+  // with `dedup_strings`, stat reports the engine's deduplicated bytes.
+  mruby_data_writer(
+    data_writer &writer,
+    me_mruby_engine &engine,
+    std::uint64_t in = 0,
+    const code_cache *cache = nullptr,
+    bool tabulate_symbols = false,
+    bool dedup_strings = false);
   virtual ~mruby_data_writer();
   void emit_output();
   void emit_stat();
+  // A [:chunk, value] message, for Kernel#emit.
+  const char *emit_chunk(mrb_value value);
 
 private:
   data_writer &writer;
   me_mruby_engine &engine;
   std::uint64_t in;
+  const code_cache *cache;
+  bool tabulate_symbols;
+  bool dedup_strings;
 };
 
 
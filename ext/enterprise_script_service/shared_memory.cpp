@@ -0,0 +1,45 @@
+#include "shared_memory.hpp"
+#include "error.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void *map(const int fd, std::size_t &size, int protection);
+
+const char *map_input(const int fd, std::size_t &size) {
+#ifdef F_GET_SEALS
+  int seals = fcntl(fd, F_GET_SEALS);
+  if (seals == -1 || (seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) != (F_SEAL_WRITE | F_SEAL_SHRINK)) {
+    leave(status_code::bad_input);
+  }
+#else
+  // nothing says the payload can't change under the decoder
+  leave(status_code::bad_input);
+#endif
+  return static_cast<const char *>(map(fd, size, PROT_READ));
+}
+
+char *map_output(const int fd, std::size_t &size) {
+  return static_cast<char *>(map(fd, size, PROT_READ | PROT_WRITE));
+}
+
+// HELPERS
+
+void *map(const int fd, std::size_t &size, int protection) {
+  struct stat status;
+  if (fstat(fd, &status) == -1) {
+    leave(status_code::io_failure);
+  }
+  size = static_cast<std::size_t>(status.st_size);
+  if (size == 0) {
+    leave(status_code::bad_input);
+  }
+
+  void *mapping = mmap(nullptr, size, protection, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    leave(status_code::mmap_failed);
+  }
+  close(fd); // the mapping keeps the memfd alive
+  return mapping;
+}
@@ -0,0 +1,12 @@
+#ifndef ENTERPRISE_SCRIPT_SERVICE_SHARED_MEMORY_HPP
+#define ENTERPRISE_SCRIPT_SERVICE_SHARED_MEMORY_HPP
+
+#include <cstddef>
+
+// Maps the payload in a memfd read-only. The client must have sealed it
+// against writes and shrinking, so that it can't change while being decoded.
+const char *map_input(const int fd, std::size_t &size);
+// Maps a memfd for output to be written into, as large as the client made it.
+char *map_output(const int fd, std::size_t &size);
+
+#endif
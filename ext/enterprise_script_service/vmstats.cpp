@@ -0,0 +1,53 @@
+#include "vmstats.hpp"
+#include <mruby/irep.h>
+#include <mruby/opcode.h>
+#include <cstring>
+
+vmstats::vmstats() {
+  std::memset(opcodes_, 0, sizeof(opcodes_));
+}
+
+void vmstats::count(const struct mrb_irep *irep, const mrb_code *pc) {
+  // mruby 1 packs operands into 32-bit instructions, mruby 2 has byte codes
+#ifdef GET_OPCODE
+  auto opcode = GET_OPCODE(*pc) & (OPCODES - 1);
+  auto send = (opcode == OP_SEND || opcode == OP_SENDB) ? GETARG_B(*pc) : -1;
+#else
+  auto opcode = *pc & (OPCODES - 1);
+  auto send = (opcode == OP_SEND || opcode == OP_SENDB) ? pc[2] : -1;
+#endif
+  opcodes_[opcode]++;
+  if (send >= 0) {
+    sends_[irep->syms[send]]++;
+  }
+}
+
+void vmstats::emit(struct mrb_state *mrb, out_packer &packer) {
+  std::uint32_t executed = 0;
+  for (auto count : opcodes_) {
+    executed += count > 0;
+  }
+
+  packer.pack_array(2);
+  packer.pack(symbol{"vmstats"});
+  packer.pack_map(2);
+  packer.pack(symbol{"opcodes"});
+  packer.pack_map(executed);
+  for (int opcode = 0; opcode < OPCODES; ++opcode) {
+    if (opcodes_[opcode] > 0) {
+      packer.pack_int32(opcode);
+      packer.pack_uint64(opcodes_[opcode]);
+    }
+  }
+  packer.pack(symbol{"sends"});
+  packer.pack_map(sends_.size());
+  for (auto &&send : sends_) {
+    mrb_int length;
+    auto name = mrb_sym2name_len(mrb, send.first, &length);
+    packer.pack(symbol{std::string{name, static_cast<std::size_t>(length)}});
+    packer.pack_uint64(send.second);
+  }
+
+  std::memset(opcodes_, 0, sizeof(opcodes_));
+  sends_.clear();
+}
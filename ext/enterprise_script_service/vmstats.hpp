@@ -0,0 +1,28 @@
+#ifndef ENTERPRISE_SCRIPT_SERVICE_VMSTATS_HPP
+#define ENTERPRISE_SCRIPT_SERVICE_VMSTATS_HPP
+
+#include "data.hpp"
+#include <mruby.h>
+#include <cstdint>
+#include <unordered_map>
+
+// Tallies the opcodes the VM executes and the methods its send sites call.
+// Only fed by the engine's code fetch hook when built with ME_ENABLE_VMSTATS:
+// the default build pays nothing for it.
+class vmstats {
+public:
+  vmstats();
+
+  void count(const struct mrb_irep *irep, const mrb_code *pc);
+  // A [:vmstats, {opcodes: {opcode => count}, sends: {method => count}}]
+  // message with whatever was counted since the last one.
+  void emit(struct mrb_state *mrb, out_packer &packer);
+
+private:
+  static const int OPCODES = 256;
+
+  std::uint64_t opcodes_[OPCODES];
+  std::unordered_map<mrb_sym, std::uint64_t> sends_;
+};
+
+#endif
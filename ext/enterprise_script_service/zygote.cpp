@@ -0,0 +1,181 @@
+#include "zygote.hpp"
+#include "error.hpp"
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+
+static const std::size_t REQUEST_FD_COUNT = 2; // stdin, stdout
+static const std::int32_t FORKED = -1;
+
+static bool receive_request(const int control_fd, int &in_fd, int &out_fd);
+static void send_reply(const int control_fd, const std::int32_t pid, const std::int32_t value);
+static void reap_children(const int control_fd);
+static void child_exited(int);
+
+void fork_per_request(const int control_fd, const timer &t) {
+  // SIGCHLD only gets through while waiting for a request, interrupting it
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = child_exited;
+  sigemptyset(&action.sa_mask);
+  struct sigaction previous_action;
+  sigset_t blocked, unblocked;
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &blocked, &unblocked) == -1 || sigaction(SIGCHLD, &action, &previous_action) == -1) {
+    leave(status_code::initialization_failure);
+  }
+
+  for (;;) {
+    reap_children(control_fd);
+
+    fd_set readable;
+    FD_ZERO(&readable);
+    FD_SET(control_fd, &readable);
+    if (pselect(control_fd + 1, &readable, nullptr, nullptr, nullptr, &unblocked) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      leave(status_code::io_failure);
+    }
+
+    int in_fd, out_fd;
+    if (!receive_request(control_fd, in_fd, out_fd)) {
+      leave(status_code::ok); // children carry on without the server
+    }
+
+    // the child waits for the parent to say how long forking took
+    int timing[2];
+    if (pipe(timing) == -1) {
+      close(in_fd);
+      close(out_fd);
+      send_reply(control_fd, -1, static_cast<std::int32_t>(status_code::fork_failure));
+      continue;
+    }
+
+    auto forking = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(timing[1]);
+      sigaction(SIGCHLD, &previous_action, nullptr);
+      sigprocmask(SIG_SETMASK, &unblocked, nullptr);
+      if (dup2(in_fd, STDIN_FILENO) == -1 || dup2(out_fd, STDOUT_FILENO) == -1) {
+        leave(status_code::io_failure);
+      }
+      close(in_fd);
+      close(out_fd);
+      if (control_fd != STDIN_FILENO) {
+        close(control_fd);
+      }
+
+      std::int64_t forked_us;
+      ssize_t received;
+      do {
+        received = read(timing[0], &forked_us, sizeof(forked_us));
+      } while (received == -1 && errno == EINTR);
+      close(timing[0]);
+      if (received == sizeof(forked_us)) {
+        t.writer("fork", forked_us);
+      }
+      return;
+    }
+
+    auto forked = std::chrono::steady_clock::now();
+    close(in_fd);
+    close(out_fd);
+    close(timing[0]);
+    if (pid == -1) {
+      close(timing[1]);
+      send_reply(control_fd, -1, static_cast<std::int32_t>(status_code::fork_failure));
+      continue;
+    }
+    std::int64_t forked_us = std::chrono::duration_cast<std::chrono::microseconds>(forked - forking).count();
+    if (::write(timing[1], &forked_us, sizeof(forked_us)) == -1) {
+      // the child went already: it just goes without its measurement
+    }
+    close(timing[1]);
+    send_reply(control_fd, pid, FORKED);
+  }
+}
+
+// HELPERS
+
+bool receive_request(const int control_fd, int &in_fd, int &out_fd) {
+  char byte;
+  struct iovec iov;
+  iov.iov_base = &byte;
+  iov.iov_len = sizeof(byte);
+
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(REQUEST_FD_COUNT * sizeof(int))];
+  } control;
+
+  struct msghdr message;
+  std::memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.buffer;
+  message.msg_controllen = sizeof(control.buffer);
+
+  ssize_t received;
+  do {
+    received = recvmsg(control_fd, &message, 0);
+  } while (received == -1 && errno == EINTR);
+
+  if (received == 0) {
+    return false;
+  }
+  if (received == -1) {
+    leave(status_code::io_failure);
+  }
+
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  if (header == nullptr
+      || header->cmsg_level != SOL_SOCKET
+      || header->cmsg_type != SCM_RIGHTS
+      || header->cmsg_len != CMSG_LEN(REQUEST_FD_COUNT * sizeof(int))) {
+    leave(status_code::bad_input);
+  }
+
+  int fds[REQUEST_FD_COUNT];
+  std::memcpy(fds, CMSG_DATA(header), sizeof(fds));
+  in_fd = fds[0];
+  out_fd = fds[1];
+  return true;
+}
+
+void send_reply(const int control_fd, const std::int32_t pid, const std::int32_t value) {
+  std::int32_t reply[2] = {pid, value};
+  auto buffer = reinterpret_cast<const char *>(reply);
+  auto size = sizeof(reply);
+  while (size > 0) {
+    ssize_t written = ::write(control_fd, buffer, size);
+    if (written == -1) {
+      if (errno == EINTR) continue;
+      leave(status_code::io_failure);
+    }
+    buffer += written;
+    size -= written;
+  }
+}
+
+void reap_children(const int control_fd) {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    // same encoding as the Ruby Spawner#wait
+    send_reply(control_fd, pid, WIFSIGNALED(status) ? 255 + WTERMSIG(status) : WEXITSTATUS(status));
+  }
+}
+
+void child_exited(int) {
+  // only there to interrupt pselect; children are reaped from the loop
+}
@@ -0,0 +1,13 @@
+#ifndef ENTERPRISE_SCRIPT_SERVICE_ZYGOTE_HPP
+#define ENTERPRISE_SCRIPT_SERVICE_ZYGOTE_HPP
+
+#include "timer.hpp"
+
+// Serves requests received on the control socket by forking the calling
+// process once per request, without waiting for earlier ones to finish:
+// children are reaped as they exit. Only ever returns in a forked child,
+// with the request's stdin/stdout in place of its own; the parent leaves
+// once the control socket is closed.
+void fork_per_request(const int control_fd, const timer &t);
+
+#endif
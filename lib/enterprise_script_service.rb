@@ -2,8 +2,10 @@ require("msgpack")
 require("open3")
 require("pathname")
 
+require("enterprise_script_service/batch_message_processor")
 require("enterprise_script_service/engine_error")
 require("enterprise_script_service/message_processor")
+require("enterprise_script_service/pool")
 require("enterprise_script_service/protocol")
 require("enterprise_script_service/result")
 require("enterprise_script_service/runner")
@@ -14,34 +16,139 @@ require("enterprise_script_service/stat")
 
 module EnterpriseScriptService
   class << self
-    def run(input:, sources:, instructions: nil, timeout: 1, instruction_quota: 100000, instruction_quota_start: 0, memory_quota: 8 << 20)
-      packer = EnterpriseScriptService::Protocol.packer_factory.packer
+    # When given a `pool`, its processes' quotas apply instead of the ones
+    # passed here. Values the sources `emit` are passed to `on_chunk` as they
+    # come in, or else returned as the result's chunks. With `lazy_input`, the
+    # hashes and arrays in `input` are only decoded as the sources use them.
+    # With `symbol_table`, each symbol is only named once per message. With
+    # `dedup_strings`, equal short strings in `input` are a single frozen one.
+    # Given a `time_quota`, in seconds of CPU time, the engine stops itself
+    # once it is spent, still reporting its stat; `timeout` remains a backstop.
+    # With `profile`, the result's profile attributes instructions and
+    # allocated bytes to each source and to the busiest methods and blocks. A
+    # `gc` hash tunes the engine's garbage collector: `interval_ratio` and
+    # `step_ratio` percentages, and a `mode` of :generational or :incremental.
+    # Given `shared_memory`, a number of bytes (Linux only, not with a pool),
+    # the payload is mapped by the engine rather than piped, and up to that
+    # much output comes back through shared memory too.
+    def run(input:, sources:, instructions: nil, timeout: 1, instruction_quota: 100000, instruction_quota_start: 0, memory_quota: 8 << 20, time_quota: nil, profile: false, gc: nil, pool: nil, on_chunk: nil, lazy_input: false, symbol_table: false, dedup_strings: false, shared_memory: nil)
+      raise(ArgumentError, "shared_memory doesn't apply to a pool's processes") if pool && shared_memory
 
       payload = {input: input, sources: sources}
       payload[:library] = instructions if instructions
-      encoded = packer.pack(payload)
+      payload[:lazy_input] = true if lazy_input
+      payload[:symbol_table] = true if symbol_table
+      payload[:dedup_strings] = true if dedup_strings
 
-      packer = EnterpriseScriptService::Protocol.packer_factory.packer
-      size = packer.pack(encoded.size)
+      service_process = pool || service_process(instruction_quota, instruction_quota_start, memory_quota, *time_quota_flags(time_quota), *gc_flags(gc), *("-P" if profile), shared_memory: shared_memory)
+      runner = EnterpriseScriptService::Runner.new(
+        timeout: timeout,
+        service_process: service_process,
+        message_processor_factory: on_chunk ? EnterpriseScriptService::MessageProcessor::Factory.new(on_chunk) : EnterpriseScriptService::MessageProcessor,
+      )
+      runner.run(*encode(payload))
+    end
 
-      spawner = EnterpriseScriptService::Spawner.new
-      service_process = EnterpriseScriptService::ServiceProcess.new(
-        service_path,
-        spawner,
-        instruction_quota,
-        instruction_quota_start,
-        memory_quota,
+    # Runs the sources once per input, in a single process; returns one result
+    # per input. Quotas apply to each input separately, but one exceeding them
+    # fails all the inputs that didn't complete yet.
+    def run_batch(inputs:, sources:, instructions: nil, timeout: 1, instruction_quota: 100000, instruction_quota_start: 0, memory_quota: 8 << 20, time_quota: nil, profile: false, gc: nil, lazy_input: false, symbol_table: false, dedup_strings: false)
+      payload = {inputs: inputs, sources: sources}
+      payload[:library] = instructions if instructions
+      payload[:lazy_input] = true if lazy_input
+      payload[:symbol_table] = true if symbol_table
+      payload[:dedup_strings] = true if dedup_strings
+
+      runner = EnterpriseScriptService::Runner.new(
+        timeout: timeout,
+        service_process: service_process(instruction_quota, instruction_quota_start, memory_quota, *time_quota_flags(time_quota), *gc_flags(gc), *("-P" if profile)),
+        message_processor_factory: EnterpriseScriptService::BatchMessageProcessor::Factory.new(inputs.size),
       )
+      runner.run(*encode(payload))
+    end
+
+    # Compiles the sources to mruby bytecode without running them. On success,
+    # the result's output has the same shape as `sources` and can be passed in
+    # their place to `run`.
+    def compile(sources:, timeout: 1, memory_quota: 8 << 20)
+      service_process = service_process(100000, 0, memory_quota, "-c")
       runner = EnterpriseScriptService::Runner.new(
         timeout: timeout,
         service_process: service_process,
         message_processor_factory: EnterpriseScriptService::MessageProcessor,
       )
-      runner.run(size, encoded)
+      runner.run(*encode(sources: sources))
+    end
+
+    def pool(size:, refill_concurrency: 1, instruction_quota: 100000, instruction_quota_start: 0, memory_quota: 8 << 20, time_quota: nil, gc: nil)
+      EnterpriseScriptService::Pool.new(
+        service_process: service_process(instruction_quota, instruction_quota_start, memory_quota, *time_quota_flags(time_quota), *gc_flags(gc)),
+        size: size,
+        refill_concurrency: refill_concurrency,
+      )
     end
 
     private
 
+    def encode(payload)
+      batch = payload.key?(:inputs)
+      options = {}
+      options[:batch] = true if batch
+      options[:lazy_input] = true if payload[:lazy_input]
+      options[:symbol_table] = true if payload[:symbol_table]
+      options[:dedup_strings] = true if payload[:dedup_strings]
+
+      EnterpriseScriptService::Protocol.frame(
+        (pack_input(payload, batch) if batch || payload.key?(:input)),
+        pack(payload[:sources]),
+        (pack(payload[:library]) if payload[:library]),
+        (pack(options) unless options.empty?),
+      )
+    end
+
+    # Every input is a message of its own as far as symbols go. Lazy inputs
+    # are decoded piecemeal, out of order: their symbols are spelled out.
+    def pack_input(payload, batch)
+      tabulate = payload[:symbol_table] && !payload[:lazy_input]
+      if batch
+        inputs = payload[:inputs]
+        pack(tabulate ? inputs.map { |input| EnterpriseScriptService::Protocol.tabulate(input) } : inputs)
+      else
+        input = payload[:input]
+        pack(tabulate ? EnterpriseScriptService::Protocol.tabulate(input) : input)
+      end
+    end
+
+    def pack(value)
+      packer = EnterpriseScriptService::Protocol.packer_factory.packer
+      packer.pack(value).to_s
+    end
+
+    def time_quota_flags(time_quota)
+      time_quota ? ["-t", (time_quota * 1000).ceil.to_s] : []
+    end
+
+    def gc_flags(gc)
+      return [] unless gc
+      flags = []
+      flags.push("-r", gc[:interval_ratio].to_s) if gc[:interval_ratio]
+      flags.push("-s", gc[:step_ratio].to_s) if gc[:step_ratio]
+      flags.push("-G", gc[:mode].to_s) if gc[:mode]
+      flags
+    end
+
+    def service_process(instruction_quota, instruction_quota_start, memory_quota, *flags, shared_memory: nil)
+      EnterpriseScriptService::ServiceProcess.new(
+        service_path,
+        EnterpriseScriptService::Spawner.new,
+        instruction_quota,
+        instruction_quota_start,
+        memory_quota,
+        *flags,
+        shared_memory: shared_memory,
+      )
+    end
+
     def service_path
       @service_path ||= begin
         base_path = Pathname.new(__dir__).parent
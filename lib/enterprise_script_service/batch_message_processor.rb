@@ -0,0 +1,71 @@
+module EnterpriseScriptService
+  # Splits the messages of a batch run into one MessageProcessor per item.
+  # Messages preceding the first item (compiling the sources, loading the
+  # library) apply to every item.
+  class BatchMessageProcessor
+    Factory = Struct.new(:size) do
+      def new
+        BatchMessageProcessor.new(size)
+      end
+    end
+
+    def initialize(size)
+      @batch = EnterpriseScriptService::MessageProcessor.new
+      @items = Array.new(size) { EnterpriseScriptService::MessageProcessor.new }
+      @current = @batch
+    end
+
+    # Reads every message from `channel`, yielding each one first when
+    # given a block, as MessageProcessor#process_all does.
+    def process_all(channel)
+      EnterpriseScriptService::Protocol.each_message(channel) do |raw_message|
+        if block_given?
+          yield(raw_message)
+          next if EnterpriseScriptService::MessageProcessor::HANDED_OVER.include?(raw_message.first)
+        end
+        read(raw_message)
+      end
+    rescue EOFError
+      signal_truncation
+    end
+
+    def read(raw_message)
+      type, data = raw_message
+      if type == :item
+        @current = @items.fetch(data)
+      elsif type == :profile
+        @batch.read(raw_message) # covers the whole batch
+      else
+        @current.read(raw_message)
+      end
+    end
+
+    # The engine failing affects all the items it didn't get to finish.
+    %i(signal_error signal_truncation signal_signaled).each do |name|
+      define_method(name) do |*args|
+        @items.reject(&:finished?).each { |item| item.public_send(name, *args) }
+      end
+    end
+
+    # Out of CPU time, the engine still sends the stat of the item it was
+    # running, which didn't finish all the same.
+    def signal_abnormal_exit(code)
+      @items.each do |item|
+        if !item.finished? || (code == 23 && item.equal?(@current))
+          item.signal_abnormal_exit(code)
+        end
+      end
+    end
+
+    def to_result
+      batch = @batch.to_result
+      @items.map do |item|
+        result = item.to_result
+        result.errors = batch.errors + result.errors
+        result.measurements = batch.measurements.merge(result.measurements) { |_, a, b| a + b }
+        result.profile = batch.profile
+        result
+      end
+    end
+  end
+end
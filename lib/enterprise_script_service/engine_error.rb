@@ -51,6 +51,13 @@ module EnterpriseScriptService
     end
   end
 
+  # The engine ran out of the CPU time it was given (`time_quota`).
+  class EngineCPUTimeQuotaError < EngineTimeQuotaError
+    def initialize
+      super(quota: "exhausting its CPU time")
+    end
+  end
+
   # Internal Errors
   EngineTypeError = Class.new(EngineInternalError)
   UnknownTypeError = Class.new(EngineInternalError)
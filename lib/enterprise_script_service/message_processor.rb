@@ -1,22 +1,40 @@
 module EnterpriseScriptService
   class MessageProcessor
-    def initialize
+    # Hands every chunk to `on_chunk` as soon as it is read.
+    Factory = Struct.new(:on_chunk) do
+      def new
+        MessageProcessor.new(on_chunk: on_chunk)
+      end
+    end
+
+    # Messages the caller has once yielded, which aren't kept for the result.
+    HANDED_OVER = %i(output chunk compiled).freeze
+
+    # Chunks the script emits are passed to `on_chunk` as they come in when
+    # given, or else collected in the result.
+    def initialize(on_chunk: nil)
+      @on_chunk = on_chunk
+      @chunks = nil
       @measurements = {}
       @stat = EnterpriseScriptService::Stat::Null
       @errors = []
       @output = nil
       @stdout = ""
+      @profile = nil
     end
 
+    # Reads every message from `channel`, yielding each one first when
+    # given a block; those HANDED_OVER are then not read.
     def process_all(channel)
-      unpacker = EnterpriseScriptService::Protocol.packer_factory.unpacker(channel)
-      begin
-        unpacker.each do |raw_message|
-          read(raw_message)
+      EnterpriseScriptService::Protocol.each_message(channel) do |raw_message|
+        if block_given?
+          yield(raw_message)
+          next if HANDED_OVER.include?(raw_message.first)
         end
-      rescue EOFError
-        signal_truncation
+        read(raw_message)
       end
+    rescue EOFError
+      signal_truncation
     end
 
     def signal_error(error)
@@ -50,6 +68,8 @@ module EnterpriseScriptService
         EnterpriseScriptService::EngineInstructionQuotaError.new
       when 19
         EnterpriseScriptService::EngineTypeError.new
+      when 23
+        EnterpriseScriptService::EngineCPUTimeQuotaError.new
       else
         EnterpriseScriptService::EngineAbnormalExitError.new(code: code)
       end
@@ -57,6 +77,10 @@ module EnterpriseScriptService
       signal_error(error)
     end
 
+    def finished?
+      !@stat.equal?(EnterpriseScriptService::Stat::Null)
+    end
+
     def to_result
       EnterpriseScriptService::Result.new(
         output: @output,
@@ -64,11 +88,11 @@ module EnterpriseScriptService
         stat: @stat,
         errors: @errors,
         measurements: @measurements,
+        chunks: @chunks,
+        profile: @profile,
       )
     end
 
-    private
-
     def read(raw_message)
       type, data = raw_message
       case type
@@ -76,9 +100,14 @@ module EnterpriseScriptService
       when :error then read_error(data)
       when :measurement then read_measurement(data)
       when :stat then read_stat(data)
+      when :compiled then read_compiled(data)
+      when :chunk then read_chunk(data)
+      when :profile then read_profile(data)
       end
     end
 
+    private
+
     def read_output(data)
       @output = data[:extracted]
       @stdout = data[:stdout]
@@ -108,6 +137,22 @@ module EnterpriseScriptService
         end
     end
 
+    def read_compiled(data)
+      (@output ||= []) << data
+    end
+
+    def read_chunk(data)
+      if @on_chunk
+        @on_chunk.call(data)
+      else
+        (@chunks ||= []) << data
+      end
+    end
+
+    def read_profile(data)
+      @profile = data
+    end
+
     def read_measurement(data)
       name, microseconds = *data
       if @measurements.has_key?(name) 
@@ -0,0 +1,90 @@
+module EnterpriseScriptService
+  # Keeps up to `size` service processes spawned and blocked on reading their
+  # input, so that a run doesn't have to wait for one to start. Every process
+  # handed out is replaced in the background by one of `refill_concurrency`
+  # threads. Quotas are those of the given service process.
+  class Pool
+    Stats = Struct.new(:hits, :waits, :spawns, :spawn_time, keyword_init: true)
+
+    attr_reader(:service_process, :size)
+
+    def initialize(service_process:, size:, refill_concurrency: 1)
+      raise(ArgumentError, "size must be positive") unless size > 0
+      raise(ArgumentError, "refill_concurrency must be positive") unless refill_concurrency > 0
+
+      @service_process = service_process
+      @size = size
+      @mutex = Mutex.new
+      @ready_condition = ConditionVariable.new
+      @ready = []
+      @refills = Queue.new
+      @stats = Stats.new(hits: 0, waits: 0, spawns: 0, spawn_time: 0.0)
+
+      size.times { @refills << :spawn }
+      @refillers = Array.new(refill_concurrency) { Thread.new { refill } }
+    end
+
+    # Same interface as ServiceProcess#open, using a process from the pool;
+    # being spawned ahead, such processes read their payload from stdin.
+    def open(*, &block)
+      service_process.communicate(checkout, &block)
+    end
+
+    def checkout
+      spawned = @mutex.synchronize do
+        if @ready.empty?
+          @stats.waits += 1
+          @ready_condition.wait(@mutex) while @ready.empty? && !@refills.closed?
+        else
+          @stats.hits += 1
+        end
+        raise(ClosedQueueError, "pool is shut down") if @refills.closed?
+
+        @refills << :spawn
+        @ready.shift
+      end
+
+      # a failed spawn is reported to whoever would have gotten its process
+      raise(spawned) if spawned.is_a?(Exception)
+      spawned
+    end
+
+    def stats
+      @mutex.synchronize { @stats.dup }
+    end
+
+    def shutdown
+      @refills.clear
+      @refills.close
+      @refillers.each(&:join)
+
+      @mutex.synchronize do
+        @ready.each { |spawned| service_process.stop(spawned) unless spawned.is_a?(Exception) }
+        @ready.clear
+        @ready_condition.broadcast
+      end
+      nil
+    end
+
+    private
+
+    def refill
+      while @refills.pop
+        started_at = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        spawned = begin
+          service_process.start
+        rescue SystemCallError => error
+          error
+        end
+        elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started_at
+
+        @mutex.synchronize do
+          @stats.spawns += 1
+          @stats.spawn_time += elapsed
+          @ready << spawned
+          @ready_condition.signal
+        end
+      end
+    end
+  end
+end
@@ -1,13 +1,114 @@
 module EnterpriseScriptService
   module Protocol
+    HEADER_MAGIC = "\xC1ESS".b.freeze
+    HEADER_VERSION = 1
+
+    SYMBOL = 0x00
+    # The symbol table extension: within a message, a symbol's first
+    # occurrence defines the next id, from 0, and later ones refer to it.
+    SYMBOL_DEFINITION = 0x01
+    SYMBOL_REFERENCE = 0x02
+    REFERENCE_FORMATS = {1 => "C", 2 => "n", 4 => "N"}.freeze
+
+    # How much output to ask the engine's pipe for at once.
+    READ_BUFFER_SIZE = 256 << 10
+
+    SymbolDefinition = Struct.new(:name)
+    SymbolReference = Struct.new(:id) do
+      def to_msgpack_ext
+        [id].pack(REFERENCE_FORMATS.fetch(id <= 0xff ? 1 : id <= 0xffff ? 2 : 4))
+      end
+    end
+
+    # The symbols defined so far in a message, by id.
+    class SymbolTable
+      def initialize
+        @symbols = []
+      end
+
+      def define(name)
+        symbol = name.to_sym
+        @symbols << symbol
+        symbol
+      end
+
+      def fetch(reference)
+        @symbols.fetch(reference.unpack1(REFERENCE_FORMATS.fetch(reference.bytesize)))
+      end
+
+      def clear
+        @symbols.clear
+      end
+    end
+
     class << self
+      # Puts the header the engine expects in front of packed sections (nil
+      # when absent). The input goes last, so that the engine can compile the
+      # sources while it comes in.
+      def frame(input, sources, library, options)
+        sections = [input, sources, library, options]
+        order = [1, 2, 3, 0]
+        table = []
+        offset = 0
+        order.each do |i|
+          size = sections[i] ? sections[i].bytesize : 0
+          table[i] = [offset, size]
+          offset += size
+        end
+
+        header = [HEADER_MAGIC, HEADER_VERSION, offset, *table.flatten].pack("a4Cx3Q>Q>*")
+        [header, *sections.values_at(*order).compact]
+      end
+
+      # Replaces the symbols in `value` with definitions and references, to be
+      # packed as one message under the symbol table extension.
+      def tabulate(value, ids = {})
+        case value
+        when Symbol
+          if (id = ids[value])
+            SymbolReference.new(id)
+          else
+            ids[value] = ids.size
+            SymbolDefinition.new(value.to_s)
+          end
+        when Hash
+          value.each_with_object({}) { |(key, element), hash| hash[tabulate(key, ids)] = tabulate(element, ids) }
+        when Array
+          value.map { |element| tabulate(element, ids) }
+        else
+          value
+        end
+      end
+
       def packer_factory
         @packer_factory ||= begin
           factory = MessagePack::Factory.new
-          factory.register_type(0x00, Symbol)
+          factory.register_type(SYMBOL, Symbol)
+          factory.register_type(SYMBOL_DEFINITION, SymbolDefinition, packer: :name)
+          factory.register_type(SYMBOL_REFERENCE, SymbolReference, packer: :to_msgpack_ext)
           factory
         end
       end
+
+      # Unpacks messages from `io`, resolving the symbol table extension
+      # against `symbols`, to be cleared between messages.
+      def unpacker(io, symbols)
+        factory = MessagePack::Factory.new
+        factory.register_type(SYMBOL, Symbol)
+        factory.register_type(SYMBOL_DEFINITION, SymbolDefinition, unpacker: ->(name) { symbols.define(name) })
+        factory.register_type(SYMBOL_REFERENCE, SymbolReference, unpacker: ->(reference) { symbols.fetch(reference) })
+        factory.unpacker(io, io_buffer_size: READ_BUFFER_SIZE)
+      end
+
+      # Yields the messages read from `io` as soon as each is complete.
+      # Raises EOFError when the stream ends within a message.
+      def each_message(io)
+        symbols = SymbolTable.new
+        unpacker(io, symbols).each do |message|
+          symbols.clear # each message has its own
+          yield(message)
+        end
+      end
     end
   end
 end
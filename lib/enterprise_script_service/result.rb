@@ -1,5 +1,5 @@
 module EnterpriseScriptService
-  Result = Struct.new(:output, :stdout, :stat, :measurements, :errors, keyword_init: true) do
+  Result = Struct.new(:output, :stdout, :stat, :measurements, :errors, :chunks, :profile, keyword_init: true) do
     def success?
       errors.empty?
     end
@@ -4,20 +4,46 @@ module EnterpriseScriptService
   class Runner
     attr_reader(:timeout, :service_process, :message_processor_factory)
 
+    # Bounds every write and read on a channel by one deadline, so that what
+    # happens in between isn't timed.
+    class TimedChannel
+      def initialize(channel, timeout)
+        @channel = channel
+        @deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + timeout
+      end
+
+      %i(write read readpartial).each do |name|
+        define_method(name) do |*args|
+          left = @deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+          raise(Timeout::Error) unless left > 0
+          Timeout.timeout(left) { @channel.public_send(name, *args) }
+        end
+      end
+    end
+
     def initialize(timeout:, service_process:, message_processor_factory:)
       @timeout = timeout
       @service_process = service_process
       @message_processor_factory = message_processor_factory
     end
 
-    def run(*data)
+    # Yields each message as it is read, when given a block, before returning
+    # the result once the engine exits. The block isn't timed: only writing
+    # the payload and reading the messages count against the timeout.
+    def run(*data, &on_message)
       message_processor = message_processor_factory.new
 
       begin
-        code = service_process.open do |channel|
-          Timeout.timeout(timeout) do
-            data.each { |datum| channel.write(datum) } 
-            message_processor.process_all(channel)
+        code = service_process.open(*data) do |channel|
+          if on_message
+            channel = TimedChannel.new(channel, timeout)
+            data.each { |datum| channel.write(datum) }
+            message_processor.process_all(channel, &on_message)
+          else
+            Timeout.timeout(timeout) do
+              data.each { |datum| channel.write(datum) } 
+              message_processor.process_all(channel)
+            end
           end
         end
 
@@ -34,5 +60,13 @@ module EnterpriseScriptService
 
       message_processor.to_result
     end
+
+    # Like #run, but meant for consuming the messages as they arrive:
+    # measurements, chunks, errors and the stat. The output, chunks and
+    # compiled sources yielded aren't kept in the result.
+    def run_streaming(*data, &block)
+      raise ArgumentError, "no block given" unless block
+      run(*data, &block)
+    end
   end
 end
@@ -1,13 +1,19 @@
 module EnterpriseScriptService
   class ServiceChannel
-    attr_reader(:in_writer, :out_reader)
+    attr_reader(:in_writer, :out_reader, :output_memory)
 
-    def initialize(in_writer, out_reader)
+    # With `output_memory`, the engine mapped its payload and writes the
+    # start of its output into that memfd. Its stdout then starts with a
+    # [:mapped, size] record: the output is that many bytes of the memfd,
+    # followed by the rest of stdout.
+    def initialize(in_writer, out_reader, output_memory = nil)
       @in_writer = in_writer
       @out_reader = out_reader
+      @output_memory = output_memory
     end
 
     def write(buffer)
+      return if output_memory # the engine has the payload already
       in_writer.write(buffer)
       nil
     rescue Errno::EPIPE
@@ -16,5 +22,34 @@ module EnterpriseScriptService
     def read(*args)
       out_reader.read(*args)
     end
+
+    # Returns whatever output is available, so that messages can be
+    # unpacked as they come in rather than once a whole buffer is read.
+    def readpartial(*args)
+      if output_memory && !@mapped_read
+        @mapped_read = true
+        mapped = read_mapped
+        return mapped unless mapped.empty?
+      end
+      out_reader.readpartial(*args)
+    end
+
+    private
+
+    def read_mapped
+      # a byte at a time, so that whatever follows the record is left for
+      # readpartial
+      unpacker = EnterpriseScriptService::Protocol.packer_factory.unpacker
+      record = nil
+      until record
+        byte = out_reader.read(1)
+        raise(EOFError, "output ended before saying how much of it was mapped") unless byte
+        unpacker.feed_each(byte) { |object| record = object }
+      end
+
+      type, size = record
+      raise(EOFError, "output doesn't start with a mapped record") unless type == :mapped && size.is_a?(Integer)
+      size > 0 ? output_memory.pread(size, 0) : "".b
+    end
   end
 end
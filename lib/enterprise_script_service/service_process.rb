@@ -1,51 +1,92 @@
 module EnterpriseScriptService
   class ServiceProcess
-    attr_reader(:path, :spawner, :instruction_quota, :instruction_quota_start, :memory_quota)
+    Spawned = Struct.new(:pid, :in_writer, :out_reader, :output_memory)
 
-    def initialize(path, spawner, instruction_quota, instruction_quota_start, memory_quota)
+    INPUT_MEMORY_FD = 3
+    OUTPUT_MEMORY_FD = 4
+
+    attr_reader(:path, :spawner, :instruction_quota, :instruction_quota_start, :memory_quota, :flags, :shared_memory)
+
+    # Given `shared_memory`, a number of bytes, processes started with a
+    # payload map it from a sealed memfd rather than reading it from their
+    # stdin, and write up to that much output into another memfd.
+    def initialize(path, spawner, instruction_quota, instruction_quota_start, memory_quota, *flags, shared_memory: nil)
       @path = path
       @spawner = spawner
       @instruction_quota = instruction_quota
       @instruction_quota_start = instruction_quota_start
       @memory_quota = memory_quota
+      @flags = flags
+      @shared_memory = shared_memory
+    end
+
+    def open(*data, &block)
+      communicate(start(*data), &block)
     end
 
-    def open
+    def start(*data)
       in_reader, in_writer = IO.pipe
       out_reader, out_writer = IO.pipe
 
+      mapped = []
+      memory = {}
+      if shared_memory && !data.empty?
+        memory[INPUT_MEMORY_FD] = spawner.memfd("ess-input", data.join)
+        memory[OUTPUT_MEMORY_FD] = spawner.memfd("ess-output", size: shared_memory)
+        mapped = ["-I", INPUT_MEMORY_FD.to_s, "-O", OUTPUT_MEMORY_FD.to_s]
+      end
+
       pid = spawner.spawn(
         path,
         "-i", instruction_quota.to_s,
         "-C", instruction_quota_start.to_s,
         "-m", memory_quota.to_s,
+        *flags,
+        *mapped,
         in: in_reader,
         out: out_writer,
         unsetenv_others: true,
+        **memory,
       )
 
       in_reader.close
       out_writer.close
+      memory[INPUT_MEMORY_FD]&.close
 
       in_writer.binmode
       out_reader.binmode
 
+      Spawned.new(pid, in_writer, out_reader, memory[OUTPUT_MEMORY_FD])
+    rescue
+      memory&.each_value { |io| io.close unless io.closed? }
+      raise
+    end
+
+    def communicate(spawned)
       begin
-        yield EnterpriseScriptService::ServiceChannel.new(in_writer, out_reader)
+        yield EnterpriseScriptService::ServiceChannel.new(spawned.in_writer, spawned.out_reader, spawned.output_memory)
       ensure
-        code = spawner.wait(pid, Process::WNOHANG) || begin
-          begin
-            spawner.kill(9, pid)
-            spawner.wait(pid)
-          rescue Errno::ESRCH
-            code = -1
-          end
-        end
+        code = stop(spawned)
+      end
 
-        out_reader.close
-        in_writer.close
+      code
+    end
+
+    def stop(spawned)
+      pid = spawned.pid
+      code = spawner.wait(pid, Process::WNOHANG) || begin
+        begin
+          spawner.kill(9, pid)
+          spawner.wait(pid)
+        rescue Errno::ESRCH
+          code = -1
+        end
       end
 
+      spawned.out_reader.close
+      spawned.in_writer.close
+      spawned.output_memory&.close
+
       code
     end
   end
@@ -1,5 +1,12 @@
 module EnterpriseScriptService
   class Spawner
+    MFD_CLOEXEC = 0x0001
+    MFD_ALLOW_SEALING = 0x0002
+    F_ADD_SEALS = 1033
+    F_SEAL_SHRINK = 0x0002
+    F_SEAL_GROW = 0x0004
+    F_SEAL_WRITE = 0x0008
+
     def spawn(*)
       super
     end
@@ -17,5 +24,38 @@ module EnterpriseScriptService
     def kill(signal, pid)
       Process.kill(signal, pid)
     end
+
+    # A memfd (Linux only) for the engine to map: holding `content` and
+    # sealed against any change, or else `size` bytes long for it to write to.
+    def memfd(name, content = nil, size: nil)
+      fd = memfd_create.call(name, MFD_CLOEXEC | MFD_ALLOW_SEALING)
+      raise(SystemCallError.new("memfd_create", Fiddle.last_error)) if fd == -1
+
+      memory = File.for_fd(fd, "r+b")
+      if content
+        memory.write(content)
+        memory.flush # sealed against writes from then on
+        memory.fcntl(F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+      else
+        memory.truncate(size)
+      end
+      memory
+    rescue
+      memory&.close
+      raise
+    end
+
+    private
+
+    def memfd_create
+      @memfd_create ||= begin
+        require("fiddle")
+        Fiddle::Function.new(
+          Fiddle::Handle::DEFAULT["memfd_create"],
+          [Fiddle::TYPE_VOIDP, Fiddle::TYPE_INT],
+          Fiddle::TYPE_INT,
+        )
+      end
+    end
   end
 end
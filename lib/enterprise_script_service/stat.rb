@@ -5,7 +5,14 @@ module EnterpriseScriptService
     :bytes_in,
     :time,
     :execution_time_us,
-    :total_instructions
+    :total_instructions,
+    :cache_hits,
+    :cache_misses,
+    :dedup_bytes,
+    :gc_cycles,
+    :gc_time_us,
+    :live_objects,
+    :peak_live_objects
   ) do
     def initialize(options)
       super(
@@ -14,7 +21,14 @@ module EnterpriseScriptService
         options[:bytes_in],
         options[:time],
         options[:execution_time_us],
-        options[:total_instructions]
+        options[:total_instructions],
+        options[:cache_hits],
+        options[:cache_misses],
+        options[:dedup_bytes],
+        options[:gc_cycles],
+        options[:gc_time_us],
+        options[:live_objects],
+        options[:peak_live_objects]
       )
     end
   end
@@ -0,0 +1,97 @@
+RSpec.describe(EnterpriseScriptService::BatchMessageProcessor) do
+  let(:message_processor) { EnterpriseScriptService::BatchMessageProcessor.new(3) }
+
+  let(:packer) { EnterpriseScriptService::Protocol.packer_factory.packer }
+
+  def stream(*messages)
+    messages.each { |message| packer.pack(message) }
+    StringIO.new(packer.to_s)
+  end
+
+  let(:stat) do
+    {instructions: 1, memory: 2, bytes_in: 3, execution_time_us: 4, total_instructions: 5}
+  end
+
+  it "splits messages per item" do
+    message_processor.process_all(stream(
+      [:measurement, [:compile, 10]],
+      [:item, 0],
+      [:measurement, [:eval, 1]],
+      [:output, extracted: 2, stdout: ""],
+      [:stat, stat],
+      [:item, 1],
+      [:measurement, [:eval, 2]],
+      [:output, extracted: 40, stdout: "hi"],
+      [:stat, stat],
+      [:item, 2],
+      [:output, extracted: 600, stdout: ""],
+      [:stat, stat],
+    ))
+
+    results = message_processor.to_result
+    expect(results.map(&:output)).to eq([2, 40, 600])
+    expect(results.map(&:stdout)).to eq(["", "hi", ""])
+    expect(results.map(&:success?)).to eq([true, true, true])
+    expect(results.map(&:measurements)).to eq([
+      {compile: 10, eval: 1},
+      {compile: 10, eval: 2},
+      {compile: 10},
+    ])
+  end
+
+  it "reports errors preceding the first item for every item" do
+    message_processor.process_all(stream(
+      [:error, __type: :syntax, message: "oops", filename: "a.rb", line_number: 1, column: 2],
+    ))
+
+    results = message_processor.to_result
+    expect(results.size).to eq(3)
+    expect(results.map { |result| result.errors.map(&:class) })
+      .to all(eq([EnterpriseScriptService::EngineSyntaxError]))
+  end
+
+  it "gives every item the profile of the whole batch" do
+    profile = {setup: {instructions: 1, bytes: 2}, sources: [], methods: []}
+    message_processor.process_all(stream(
+      [:item, 0],
+      [:stat, stat],
+      [:item, 1],
+      [:stat, stat],
+      [:item, 2],
+      [:stat, stat],
+      [:profile, profile],
+    ))
+
+    expect(message_processor.to_result.map(&:profile)).to all(eq(profile))
+  end
+
+  it "fails the items that didn't finish when the engine does" do
+    message_processor.process_all(stream(
+      [:item, 0],
+      [:output, extracted: 2, stdout: ""],
+      [:stat, stat],
+      [:item, 1],
+    ))
+    message_processor.signal_abnormal_exit(17)
+
+    results = message_processor.to_result
+    expect(results.map(&:success?)).to eq([true, false, false])
+    expect(results.last.errors.first).to be_a(EnterpriseScriptService::EngineInstructionQuotaError)
+  end
+
+  it "fails the item the engine ran out of time on despite its stat" do
+    message_processor.process_all(stream(
+      [:item, 0],
+      [:output, extracted: 2, stdout: ""],
+      [:stat, stat],
+      [:item, 1],
+      [:stat, stat],
+    ))
+    message_processor.signal_abnormal_exit(23)
+
+    results = message_processor.to_result
+    expect(results.map(&:success?)).to eq([true, false, false])
+    expect(results[1].stat.instructions).to eq(stat[:instructions])
+    expect(results[1].errors.first).to be_a(EnterpriseScriptService::EngineCPUTimeQuotaError)
+  end
+end
@@ -22,6 +22,46 @@ RSpec.describe(EnterpriseScriptService::MessageProcessor) do
     )
   end
 
+  it "resolves symbol tables within each message" do
+    protocol = EnterpriseScriptService::Protocol
+    packer.pack([:chunk, protocol.tabulate([:dog, :dog])])
+    packer.pack([:chunk, protocol.tabulate([:cat, :dog, :cat])])
+    io = StringIO.new(packer.to_s)
+
+    message_processor.process_all(io)
+    expect(message_processor.to_result.chunks).to eq([[:dog, :dog], [:cat, :dog, :cat]])
+  end
+
+  it "yields each message before reading it" do
+    packer.pack([:measurement, ["decode", 10]])
+    packer.pack([:chunk, "dog"])
+    io = StringIO.new(packer.to_s)
+
+    messages = []
+    message_processor.process_all(io) do |message|
+      messages << [message, message_processor.to_result.measurements]
+    end
+    expect(messages).to eq([
+      [[:measurement, ["decode", 10]], {}],
+      [[:chunk, "dog"], {"decode" => 10}],
+    ])
+  end
+
+  it "doesn't keep the output and chunks it yields" do
+    packer.pack([:chunk, "dog"])
+    packer.pack([:output, extracted: 1, stdout: ""])
+    packer.pack([:measurement, ["decode", 10]])
+    io = StringIO.new(packer.to_s)
+
+    messages = []
+    message_processor.process_all(io) { |message| messages << message }
+    expect(messages.map(&:first)).to eq([:chunk, :output, :measurement])
+    result = message_processor.to_result
+    expect(result.chunks).to be_nil
+    expect(result.output).to be_nil
+    expect(result.measurements).to eq("decode" => 10)
+  end
+
   it "processes a runtime error message" do
     io = StringIO.new(packer.pack([
       :error,
@@ -238,6 +278,15 @@ RSpec.describe(EnterpriseScriptService::MessageProcessor) do
       ])
     end
 
+    it "returns an EngineCPUTimeQuotaError when called with code 23" do
+      message_processor.signal_abnormal_exit(23)
+      errors = message_processor.to_result.errors
+
+      expect(errors).to eq([
+        EnterpriseScriptService::EngineCPUTimeQuotaError.new,
+      ])
+    end
+
     it "returns an EngineAbnormalExitError for an unspecific code" do
       message_processor.signal_abnormal_exit(123)
       errors = message_processor.to_result.errors
@@ -248,6 +297,39 @@ RSpec.describe(EnterpriseScriptService::MessageProcessor) do
     end
   end
 
+  it "processes a profile message" do
+    profile = {
+      setup: {instructions: 1, bytes: 2},
+      sources: [{instructions: 3, bytes: 4}],
+      methods: [{method: :spin, source: 0, instructions: 3, bytes: 4}],
+    }
+    io = StringIO.new(packer.pack([:profile, profile]))
+
+    message_processor.process_all(io)
+    expect(message_processor.to_result.profile).to eq(profile)
+  end
+
+  it "collects chunks in order" do
+    packer.pack([:chunk, 1])
+    packer.pack([:chunk, {two: 2}])
+    io = StringIO.new(packer.to_s)
+
+    message_processor.process_all(io)
+    expect(message_processor.to_result.chunks).to eq([1, {two: 2}])
+  end
+
+  it "passes chunks to on_chunk as they are read" do
+    chunks = []
+    message_processor = EnterpriseScriptService::MessageProcessor::Factory.new(chunks.method(:<<)).new
+    packer.pack([:chunk, 1])
+    packer.pack([:chunk, 2])
+    io = StringIO.new(packer.to_s)
+
+    message_processor.process_all(io)
+    expect(chunks).to eq([1, 2])
+    expect(message_processor.to_result.chunks).to be_nil
+  end
+
   describe "#signal_signaled" do
     it "returns an EngineIllegalSyscallError when called with signal 31" do
       message_processor.signal_signaled(31)
@@ -0,0 +1,55 @@
+RSpec.describe(EnterpriseScriptService::Pool) do
+  let(:service_process) do
+    service_process = instance_double(EnterpriseScriptService::ServiceProcess)
+    spawned = 0
+    allow(service_process).to receive(:start) { spawned += 1 }
+    allow(service_process).to receive(:stop)
+    service_process
+  end
+
+  let(:pool) do
+    EnterpriseScriptService::Pool.new(service_process: service_process, size: 2)
+  end
+
+  after { pool.shutdown }
+
+  it "hands out processes spawned ahead of time" do
+    sleep(0.01) until pool.stats.spawns == 2
+
+    expect([pool.checkout, pool.checkout]).to contain_exactly(1, 2)
+    expect(pool.stats.hits).to eq(2)
+  end
+
+  it "replaces every process handed out" do
+    3.times { pool.checkout }
+    sleep(0.01) until pool.stats.spawns == 5
+
+    expect(pool.stats.hits + pool.stats.waits).to eq(3)
+    expect(pool.stats.spawn_time).to be >= 0
+  end
+
+  it "runs through the service process" do
+    channel = instance_double(EnterpriseScriptService::ServiceChannel)
+    expect(service_process).to receive(:communicate) do |spawned, &block|
+      expect(spawned).to be_a(Integer)
+      block.call(channel)
+      0
+    end
+
+    expect(pool.open { |c| expect(c).to be(channel) }).to eq(0)
+  end
+
+  it "reports failed spawns to the next checkout" do
+    allow(service_process).to receive(:start).and_raise(Errno::EAGAIN)
+
+    expect { pool.checkout }.to raise_error(Errno::EAGAIN)
+  end
+
+  it "stops idle processes on shutdown" do
+    sleep(0.01) until pool.stats.spawns == 2
+
+    expect(service_process).to receive(:stop).twice
+    pool.shutdown
+    expect { pool.checkout }.to raise_error(ClosedQueueError)
+  end
+end
@@ -65,6 +65,80 @@ RSpec.describe(EnterpriseScriptService::Runner) do
     end
   end
 
+  context "#run_streaming" do
+    let(:channel) do
+      channel = instance_double(EnterpriseScriptService::ServiceChannel)
+      allow(channel).to receive(:write).with("hello")
+      channel
+    end
+
+    let(:runner) do
+      EnterpriseScriptService::Runner.new(
+        timeout: 10,
+        service_process: service_process,
+        message_processor_factory: message_processor_factory,
+      )
+    end
+
+    it "yields the messages as the processor reads them" do
+      expect(service_process).to receive(:open) do |&block|
+        block.call(channel)
+        0
+      end
+      expect(message_processor).to receive(:process_all).once
+        .with(an_instance_of(EnterpriseScriptService::Runner::TimedChannel)) do |&block|
+        block.call([:chunk, "dog"])
+      end
+
+      messages = []
+      expect(runner.run_streaming("hello") { |message| messages << message }).to be(result)
+      expect(messages).to eq([[:chunk, "dog"]])
+    end
+
+    it "doesn't time the block" do
+      runner = EnterpriseScriptService::Runner.new(
+        timeout: 0.01,
+        service_process: service_process,
+        message_processor_factory: message_processor_factory,
+      )
+      expect(service_process).to receive(:open) do |&block|
+        block.call(channel)
+        0
+      end
+      expect(message_processor).to receive(:process_all) do |&block|
+        block.call([:chunk, "dog"])
+      end
+      expect(message_processor).not_to receive(:signal_error)
+
+      expect(runner.run_streaming("hello") { sleep(0.05) }).to be(result)
+    end
+
+    it "times out on reads" do
+      runner = EnterpriseScriptService::Runner.new(
+        timeout: 0.01,
+        service_process: service_process,
+        message_processor_factory: message_processor_factory,
+      )
+      allow(channel).to receive(:readpartial) { sleep(1) }
+      expect(service_process).to receive(:open) do |&block|
+        block.call(channel)
+        0
+      end
+      expect(message_processor).to receive(:process_all) do |timed_channel|
+        timed_channel.readpartial(1)
+      end
+      expect(message_processor).to receive(:signal_error).once.with(
+        EnterpriseScriptService::EngineTimeQuotaError.new(quota: 0.01),
+      )
+
+      expect(runner.run_streaming("hello") {}).to be(result)
+    end
+
+    it "requires a block" do
+      expect { runner.run_streaming("hello") }.to raise_error(ArgumentError)
+    end
+  end
+
   context "#run times out" do
     let(:channel) do
       instance_double(EnterpriseScriptService::ServiceChannel)
@@ -1,3 +1,5 @@
+require("tempfile")
+
 RSpec.describe(EnterpriseScriptService::ServiceChannel) do
   let(:writer) { instance_double(IO, "writer") }
   let(:reader) { instance_double(IO, "reader") }
@@ -20,4 +22,39 @@ RSpec.describe(EnterpriseScriptService::ServiceChannel) do
     expect(reader).to receive(:read).and_return("hello")
     expect(service_channel.read).to eq("hello")
   end
+
+  it "forwards #readpartial to the reader" do
+    expect(reader).to receive(:readpartial).with(4096).and_return("hello")
+    expect(service_channel.readpartial(4096)).to eq("hello")
+  end
+
+  it "ignores writes once the engine mapped its payload" do
+    service_channel = EnterpriseScriptService::ServiceChannel.new(writer, reader, instance_double(File))
+    expect(writer).not_to receive(:write)
+    expect(service_channel.write("hello")).to eq(nil)
+  end
+
+  it "reads what the engine mapped before the rest of its output" do
+    factory = EnterpriseScriptService::Protocol.packer_factory
+    stream = factory.packer.pack([:measurement, ["decode", 10]]).pack([:chunk, "dog"]).to_s
+    split = stream.bytesize - 3 # within the chunk
+
+    memory = Tempfile.create("output", binmode: true)
+    memory.write(stream.byteslice(0, split) + "unused")
+    memory.flush
+    out_reader, out_writer = IO.pipe
+    out_writer.write(factory.packer.pack([:mapped, split]).to_s + stream.byteslice(split..-1))
+    out_writer.close
+
+    service_channel = EnterpriseScriptService::ServiceChannel.new(writer, out_reader, memory)
+    messages = []
+    EnterpriseScriptService::Protocol.each_message(service_channel) { |message| messages << message }
+    expect(messages).to eq([[:measurement, ["decode", 10]], [:chunk, "dog"]])
+  ensure
+    if memory
+      memory.close
+      File.unlink(memory.path)
+    end
+    out_reader&.close
+  end
 end
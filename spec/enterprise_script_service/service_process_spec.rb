@@ -44,6 +44,14 @@ RSpec.describe(EnterpriseScriptService::ServiceProcess) do
     end
   end
 
+  it "open passes extra flags to process" do
+    service_process = EnterpriseScriptService::ServiceProcess.new(service_path, spawner, 100000, 2, 4 << 20, "-c")
+    expect(spawner)
+      .to receive(:spawn).once.with(instance_of(String), "-i", 100000.to_s, "-C", 2.to_s, "-m", (4 << 20).to_s, "-c", instance_of(Hash))
+    service_process.open do |c|
+    end
+  end
+
   it "optimistically tries to wait on the child without killing" do
     expect(spawner)
       .to receive(:wait).once.with(pid, Process::WNOHANG).and_return(0)
@@ -82,4 +90,31 @@ RSpec.describe(EnterpriseScriptService::ServiceProcess) do
     expect(spawner).to receive(:kill).once.with(9, pid).and_raise(Errno::ESRCH)
     expect(service_process.open { }).to eq(-1)
   end
+
+  it "maps the payload and the output into memfds when given shared memory" do
+    service_process = EnterpriseScriptService::ServiceProcess.new(service_path, spawner, 100000, 2, 4 << 20, shared_memory: 1 << 20)
+    input_memory = instance_double(File, "input memory", close: nil)
+    output_memory = instance_double(File, "output memory", close: nil)
+    expect(spawner).to receive(:memfd).with("ess-input", "headerbody").and_return(input_memory)
+    expect(spawner).to receive(:memfd).with("ess-output", size: 1 << 20).and_return(output_memory)
+    expect(spawner).to receive(:spawn) do |*args, **options|
+      expect(args.last(4)).to eq(["-I", "3", "-O", "4"])
+      expect(options).to include(3 => input_memory, 4 => output_memory)
+      pid
+    end
+
+    service_process.open("header", "body") do |channel|
+      expect(input_memory).to have_received(:close)
+      expect(channel.output_memory).to be(output_memory)
+    end
+    expect(output_memory).to have_received(:close)
+  end
+
+  it "pipes the payload when not given one to map" do
+    service_process = EnterpriseScriptService::ServiceProcess.new(service_path, spawner, 100000, 2, 4 << 20, shared_memory: 1 << 20)
+    expect(spawner).not_to receive(:memfd)
+    service_process.open do |channel|
+      expect(channel.output_memory).to be_nil
+    end
+  end
 end
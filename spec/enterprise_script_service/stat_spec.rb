@@ -2,11 +2,22 @@ RSpec.describe(EnterpriseScriptService::Stat) do
   let(:null_stat) { EnterpriseScriptService::Stat::Null }
 
   it "supports all stats" do
-    options = {instructions: 1, memory: 2, bytes_in: 3, time: 4, execution_time_us: 5, total_instructions: 6}
+    options = {
+      instructions: 1, memory: 2, bytes_in: 3, time: 4, execution_time_us: 5, total_instructions: 6,
+      gc_cycles: 7, gc_time_us: 8, live_objects: 9, peak_live_objects: 10,
+    }
     stat = EnterpriseScriptService::Stat.new(options)
     expect(stat).to have_attributes(options)
   end
 
+  it "leaves cache stats out unless the engine reports them" do
+    stat = EnterpriseScriptService::Stat.new(instructions: 1)
+    expect(stat).to have_attributes(cache_hits: nil, cache_misses: nil)
+
+    stat = EnterpriseScriptService::Stat.new(cache_hits: 7, cache_misses: 1)
+    expect(stat).to have_attributes(cache_hits: 7, cache_misses: 1)
+  end
+
   it "nullStats are all zero" do
     default_values = {instructions: 0, memory: 0, bytes_in: 0, time: 0, execution_time_us: 0, total_instructions: 0}
     expect(null_stat).to have_attributes(default_values)
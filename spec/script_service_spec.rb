@@ -16,6 +16,171 @@ RSpec.describe(EnterpriseScriptService) do
     expect(result.stdout).to eq("hello")
   end
 
+  it "evaluates scripts with pre-spawned processes" do
+    pool = EnterpriseScriptService.pool(size: 2)
+    begin
+      3.times do |i|
+        result = EnterpriseScriptService.run(
+          input: {result: i},
+          sources: [["foo", "@output = @input[:result]"]],
+          timeout: 1000,
+          pool: pool,
+        )
+        expect(result.success?).to be(true)
+        expect(result.output).to eq(i)
+      end
+      expect(pool.stats.hits + pool.stats.waits).to eq(3)
+    ensure
+      pool.shutdown
+    end
+  end
+
+  it "runs precompiled sources" do
+    compiled = EnterpriseScriptService.compile(
+      sources: [["foo", "@output = @input[:result] * 2"]],
+      timeout: 1000,
+    )
+    expect(compiled.success?).to be(true)
+    expect(compiled.output.map(&:first)).to eq(["foo"])
+    expect(compiled.output.first.last.encoding).to eq(Encoding::BINARY)
+
+    result = EnterpriseScriptService.run(
+      input: {result: 21},
+      sources: compiled.output,
+      timeout: 1000,
+    )
+    expect(result.success?).to be(true)
+    expect(result.output).to eq(42)
+  end
+
+  it "reports syntax errors when compiling" do
+    result = EnterpriseScriptService.compile(sources: [["oops", "1 +"]], timeout: 1000)
+    expect(result.success?).to be(false)
+    expect(result.errors.first).to be_a(EnterpriseScriptService::EngineSyntaxError)
+  end
+
+  it "runs sources once per input of a batch" do
+    results = EnterpriseScriptService.run_batch(
+      inputs: [{result: 1}, {result: 20}, {result: 300}],
+      sources: [["foo", "@output = (@output || 0) + @input[:result] * 2"]],
+      timeout: 1000,
+    )
+    expect(results.map(&:success?)).to eq([true, true, true])
+    expect(results.map(&:output)).to eq([2, 40, 600])
+    expect(results.map { |result| result.stat.instructions }.uniq.size).to eq(1)
+  end
+
+  it "streams emitted values" do
+    chunks = []
+    result = EnterpriseScriptService.run(
+      input: 3,
+      sources: [["foo", "@input.times { |i| emit(i => i * 2) }; @output = :done"]],
+      timeout: 1000,
+      on_chunk: ->(chunk) { chunks << chunk },
+    )
+    expect(result.success?).to be(true)
+    expect(result.output).to eq(:done)
+    expect(chunks).to eq([{0 => 0}, {1 => 2}, {2 => 4}])
+  end
+
+  it "raises a TypeError when emitting what can't be serialized" do
+    result = EnterpriseScriptService.run(
+      input: nil,
+      sources: [["foo", "begin; emit(Object.new); rescue TypeError => e; @output = e.message; end"]],
+      timeout: 1000,
+    )
+    expect(result.success?).to be(true)
+    expect(result.output).to eq("unsupported type")
+    expect(result.chunks).to be_nil
+  end
+
+  it "decodes lazy input as it is used" do
+    result = EnterpriseScriptService.run(
+      input: {cart: {total: 12, items: [{id: 1}, {id: 2}]}, unused: {deep: [1, 2, 3]}},
+      sources: [["foo", <<~RUBY]],
+        @output = [
+          @input[:cart][:total],
+          @input.dig(:cart, :items, 1, :id),
+          @input[:cart][:items].map { |item| item[:id] },
+          @input.size,
+          @input[:unused],
+        ]
+      RUBY
+      timeout: 1000,
+      lazy_input: true,
+    )
+    expect(result.success?).to be(true)
+    expect(result.output).to eq([12, 2, [1, 2], 2, {deep: [1, 2, 3]}])
+  end
+
+  it "tells lazy input proxies apart from what they hold" do
+    result = EnterpriseScriptService.run(
+      input: {cart: {total: 12, items: [{id: 1}]}},
+      sources: [["foo", <<~RUBY]],
+        cart = @input[:cart]
+        @output = [
+          cart.is_a?(Hash),
+          (case cart when Hash then true else false end),
+          cart == {total: 12, items: [{id: 1}]},
+          cart.to_h.is_a?(Hash),
+          cart.to_h == {total: 12, items: [{id: 1}]},
+          cart[:items].to_a == [{id: 1}],
+        ]
+      RUBY
+      timeout: 1000,
+      lazy_input: true,
+    )
+    expect(result.success?).to be(true)
+    expect(result.output).to eq([false, false, false, true, true, true])
+  end
+
+  it "outputs the binary strings of a lazy input as it would decoded ones" do
+    input = {used: {blob: "\xFF\x00".b}, unused: {blob: "\xFE".b, ratio: 0.5}}
+    results = [false, true].map do |lazy_input|
+      EnterpriseScriptService.run(
+        input: input,
+        sources: [["foo", "@output = [@input[:used][:blob], @input[:unused]]"]],
+        timeout: 1000,
+        lazy_input: lazy_input,
+      )
+    end
+    eager, lazy = results
+    expect(lazy.success?).to be(true)
+    expect(lazy.output).to eq(eager.output)
+    expect(lazy.output.last[:blob].encoding).to eq(eager.output.last[:blob].encoding)
+  end
+
+  it "names each symbol once per message with a symbol table" do
+    result = EnterpriseScriptService.run(
+      input: [{price: 1, quantity: 2}, {price: 3, quantity: 4}],
+      sources: [
+        ["foo", "emit([:price, :price]); @output = @input.map { |item| item.merge(total: item[:price] * item[:quantity]) }"],
+      ],
+      timeout: 1000,
+      symbol_table: true,
+    )
+    expect(result.success?).to be(true)
+    expect(result.chunks).to eq([[:price, :price]])
+    expect(result.output).to eq([
+      {price: 1, quantity: 2, total: 2},
+      {price: 3, quantity: 4, total: 12},
+    ])
+  end
+
+  it "shares equal short strings of the input when asked to" do
+    result = EnterpriseScriptService.run(
+      input: {currencies: ["USD", "USD", "CAD"], sku: "USD"},
+      sources: [
+        ["foo", "@output = [@input[:currencies][0].equal?(@input[:sku]), @input[:sku].frozen?]"],
+      ],
+      timeout: 1000,
+      dedup_strings: true,
+    )
+    expect(result.success?).to be(true)
+    expect(result.output).to eq([true, true])
+    expect(result.stat.dedup_bytes).to eq(6)
+  end
+
   it "round trips binary strings" do
     result = EnterpriseScriptService.run(
       input: "hello".force_encoding(Encoding::BINARY),
@@ -39,9 +204,9 @@ RSpec.describe(EnterpriseScriptService) do
     )
 
     expect(result.measurements.keys).to eq([
-      :in, :mem, :init, :sandbox,
-      :decode, :inject, :lib, :compile,
-      :eval, :out,
+      :mem, :init, :in, :sandbox,
+      :lib, :compile, :in_input,
+      :decode, :inject, :eval, :out,
     ])
   end
 
@@ -142,6 +307,82 @@ RSpec.describe(EnterpriseScriptService) do
     expect(result.stat.total_instructions).to be > quota
   end
 
+  it "stops the engine once its CPU time quota is spent" do
+    result = EnterpriseScriptService.run(
+      input: {},
+      sources: [["loop", "loop {}"]],
+      timeout: 1000,
+      instruction_quota: 2**62,
+      time_quota: 0.05,
+    )
+
+    expect(result.success?).to be(false)
+    expect(result.errors).to eq([EnterpriseScriptService::EngineCPUTimeQuotaError.new])
+    expect(result.stat.instructions).to be > 0
+  end
+
+  it "maps the payload and the output into shared memory when asked to", if: RUBY_PLATFORM.include?("linux") do
+    big = "x" * (64 << 10)
+    result = EnterpriseScriptService.run(
+      input: {big: big},
+      sources: [
+        ["chunks", "3.times { |i| emit(i) }"],
+        ["output", "@output = @input[:big]"],
+      ],
+      timeout: 1000,
+      shared_memory: 16 << 10, # overflows onto stdout
+    )
+
+    expect(result.errors).to eq([])
+    expect(result.chunks).to eq([0, 1, 2])
+    expect(result.output).to eq(big)
+    expect(result.stat.bytes_in).to be > big.size
+  end
+
+  it "profiles instructions per source and method when asked to" do
+    result = EnterpriseScriptService.run(
+      input: {},
+      sources: [
+        ["setup", "@output = 1"],
+        ["spin", "def spin(n) ; n.times { } ; end ; spin(100)"],
+      ],
+      timeout: 1000,
+      profile: true,
+    )
+
+    expect(result.success?).to be(true)
+    sources = result.profile.fetch(:sources)
+    expect(sources.size).to eq(2)
+    expect(sources[1][:instructions]).to be > sources[0][:instructions]
+    expect(result.profile[:setup][:instructions] + sources.sum { |source| source[:instructions] })
+      .to eq(result.stat.total_instructions)
+    expect(result.profile[:methods].map { |method| method[:method] }).to include(:spin)
+    expect(result.profile[:blocks].first).to include(source: 1)
+    expect(result.profile[:blocks].first).not_to have_key(:method)
+  end
+
+  it "runs the garbage collector as configured and reports on it" do
+    result = EnterpriseScriptService.run(
+      input: {},
+      sources: [
+        ["garbage", "@output = 20000.times.map { |i| i.to_s }.size"],
+      ],
+      timeout: 1000,
+      instruction_quota: 1_000_000,
+      memory_quota: 32 << 20,
+      gc: {interval_ratio: 100, step_ratio: 400, mode: :incremental},
+    )
+
+    expect(result.success?).to be(true)
+    expect(result.output).to eq(20000)
+    expect(result.stat.live_objects).to be > 20000
+    expect(result.stat).to have_attributes(
+      gc_cycles: a_kind_of(Integer),
+      gc_time_us: a_kind_of(Integer),
+      peak_live_objects: a_kind_of(Integer),
+    )
+  end
+
   it "supports symbols stat" do
     result = EnterpriseScriptService.run(
       input: {result: {value: 0.475}},
@@ -205,9 +446,9 @@ RSpec.describe(EnterpriseScriptService) do
     )
     expect(result.success?).to be(false)
     expect(result.measurements.keys).to eq([
-      :in, :mem, :init, :sandbox,
-      :decode, :inject, :lib, :compile,
-      :eval, :out,
+      :mem, :init, :in, :sandbox,
+      :lib, :compile, :in_input,
+      :decode, :inject, :eval, :out,
     ])
   end
 
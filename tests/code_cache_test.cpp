@@ -0,0 +1,51 @@
+#include "code_cache.hpp"
+#include "units.hpp"
+#include "gtest/gtest.h"
+#include <string>
+
+static std::uint64_t run(me_mruby_engine *engine, RProc *proc) {
+  engine->reset_instruction_count();
+  engine->eval(proc);
+  return engine->instruction_count();
+}
+
+TEST(code_cache_test, generates_code_once_per_source) {
+  me_memory_pool *allocator = me_memory_pool_new(4 * MiB);
+  me_mruby_engine *engine = me_mruby_engine_new(allocator, 100000);
+  code_cache cache(1 * MiB);
+
+  ruby_source source{"A", "@output = [1, 2, 3].map { |i| i * 2 }"};
+  auto generated = run(engine, cache.generate_code(*engine, source));
+  auto cached = run(engine, cache.generate_code(*engine, source));
+  run(engine, cache.generate_code(*engine, ruby_source{"B", source.source}));
+
+  me_mruby_engine_destroy(engine);
+  me_memory_pool_destroy(allocator);
+  EXPECT_EQ(generated, cached);
+  EXPECT_EQ(std::uint64_t{1}, cache.hits());
+  EXPECT_EQ(std::uint64_t{2}, cache.misses());
+}
+
+TEST(code_cache_test, evicts_least_recently_used_sources) {
+  me_memory_pool *allocator = me_memory_pool_new(4 * MiB);
+  me_mruby_engine *engine = me_mruby_engine_new(allocator, 100000);
+  code_cache cache(256 * KiB);
+
+  // each entry holds its source: ~100KiB apiece, only two fit
+  auto padding = "#" + std::string(100 * KiB, 'x') + "\n";
+  ruby_source a{"A", padding + "@output = 1"};
+  ruby_source b{"B", padding + "@output = 2"};
+  ruby_source c{"C", padding + "@output = 3"};
+  cache.generate_code(*engine, a);
+  cache.generate_code(*engine, b);
+  cache.generate_code(*engine, a); // b is now the least recently used
+  cache.generate_code(*engine, c);
+  cache.generate_code(*engine, a);
+  auto hits = cache.hits();
+  cache.generate_code(*engine, b);
+
+  me_mruby_engine_destroy(engine);
+  me_memory_pool_destroy(allocator);
+  EXPECT_EQ(std::uint64_t{2}, hits);
+  EXPECT_EQ(std::uint64_t{4}, cache.misses());
+}
@@ -4,6 +4,7 @@
 
 #include "data.hpp"
 #include "gtest/gtest.h"
+#include <fcntl.h>
 
 static const int BUFSIZE = 1024;
 
@@ -37,3 +38,151 @@ TEST(data_writer_test, outputs_measurements) {
   EXPECT_EQ(23, in);
   EXPECT_EQ(0, memcmp(expected, output, in));
 }
+
+TEST(data_writer_test, buffers_until_flushed) {
+  int fd[2];
+  if (pipe(fd) == -1) {
+    perror("pipe");
+    FAIL();
+  }
+  fcntl(fd[0], F_SETFL, O_NONBLOCK);
+
+  output_stream stream{fd[1], 1024};
+  out_packer packer{stream};
+  data_writer writer(packer);
+  writer.emit_measurement("foo", 42);
+  writer.emit_measurement("bar", 42);
+
+  char output[BUFSIZE];
+  EXPECT_EQ(-1, read(fd[0], output, BUFSIZE));
+
+  writer.flush();
+  EXPECT_EQ(46, read(fd[0], output, BUFSIZE));
+  close(fd[1]);
+  close(fd[0]);
+}
+
+TEST(data_writer_test, writes_large_fragments_in_order) {
+  int fd[2];
+  if (pipe(fd) == -1) {
+    perror("pipe");
+    FAIL();
+  }
+
+  std::string large(600, 'x');
+  {
+    output_stream stream{fd[1], 1024};
+    out_packer packer{stream};
+    packer.pack_array(2);
+    packer.pack_int32(42);
+    packer.pack(large);
+  }
+  close(fd[1]);
+
+  char output[BUFSIZE];
+  ssize_t r, in = 0;
+  while ((r = read(fd[0], output + in, (size_t) (BUFSIZE - in))) > 0) {
+    if ((in += r) >= BUFSIZE) break;
+  }
+  close(fd[0]);
+
+  msgpack::object_handle oh = msgpack::unpack(output, in);
+  auto object = oh.get();
+  ASSERT_EQ(msgpack::type::ARRAY, object.type);
+  EXPECT_EQ(42, object.via.array.ptr[0].as<int>());
+  EXPECT_EQ(large, object.via.array.ptr[1].as<std::string>());
+}
+
+TEST(data_writer_test, maps_output_until_full) {
+  int fd[2];
+  if (pipe(fd) == -1) {
+    perror("pipe");
+    FAIL();
+  }
+
+  char mapping[32];
+  {
+    output_stream stream{fd[1]};
+    stream.map_to(mapping, sizeof(mapping));
+    out_packer packer{stream};
+    data_writer writer(packer);
+    writer.emit_measurement("foo", 42);
+    writer.emit_measurement("bar", 42);
+  }
+  close(fd[1]);
+
+  char output[BUFSIZE];
+  ssize_t r, in = 0;
+  while ((r = read(fd[0], output + in, (size_t) (BUFSIZE - in))) > 0) {
+    if ((in += r) >= BUFSIZE) break;
+  }
+  close(fd[0]);
+
+  std::size_t offset = 0;
+  auto record = msgpack::unpack(output, in, offset);
+  ASSERT_EQ(msgpack::type::ARRAY, record.get().type);
+  EXPECT_EQ(23, record.get().via.array.ptr[1].as<int>());
+  auto mapped = msgpack::unpack(mapping, 23);
+  EXPECT_EQ(msgpack::type::ARRAY, mapped.get().type);
+  EXPECT_EQ(23, in - static_cast<ssize_t>(offset));
+}
+
+TEST(data_writer_test, keeps_mapping_output_across_flushes) {
+  int fd[2];
+  if (pipe(fd) == -1) {
+    perror("pipe");
+    FAIL();
+  }
+  fcntl(fd[0], F_SETFL, O_NONBLOCK);
+
+  char mapping[64];
+  char output[BUFSIZE];
+  {
+    output_stream stream{fd[1], 1024};
+    stream.map_to(mapping, sizeof(mapping));
+    out_packer packer{stream};
+    data_writer writer(packer);
+    writer.emit_measurement("foo", 42);
+    writer.flush();
+    writer.emit_measurement("bar", 42);
+    writer.flush();
+    EXPECT_EQ(-1, read(fd[0], output, BUFSIZE));
+  }
+  close(fd[1]);
+
+  auto in = read(fd[0], output, BUFSIZE);
+  close(fd[0]);
+  auto record = msgpack::unpack(output, in);
+  EXPECT_EQ(46, record.get().via.array.ptr[1].as<int>());
+}
+
+TEST(data_writer_test, queues_referenced_fragments_until_flushed) {
+  int fd[2];
+  if (pipe(fd) == -1) {
+    perror("pipe");
+    FAIL();
+  }
+  fcntl(fd[0], F_SETFL, O_NONBLOCK);
+
+  std::string large(600, 'x');
+  output_stream stream{fd[1], 1024};
+  out_packer packer{stream};
+  packer.pack_array(2);
+  packer.pack_str(large.size());
+  stream.write_referenced(large.data(), large.size());
+  packer.pack_int32(42);
+
+  char output[BUFSIZE];
+  EXPECT_EQ(-1, read(fd[0], output, BUFSIZE));
+
+  stream.flush_references();
+  auto in = read(fd[0], output, BUFSIZE);
+  close(fd[1]);
+  close(fd[0]);
+
+  msgpack::object_handle oh = msgpack::unpack(output, in);
+  auto object = oh.get();
+  ASSERT_EQ(msgpack::type::ARRAY, object.type);
+  EXPECT_EQ(large, object.via.array.ptr[0].as<std::string>());
+  EXPECT_EQ(42, object.via.array.ptr[1].as<int>());
+}
@@ -152,3 +152,100 @@ TEST(integration_test, large_payload) {
     runner.run(script, writer);
   }
 }
+
+static void append_big_endian(std::string &to, std::uint64_t value) {
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    to.push_back(static_cast<char>(value >> shift));
+  }
+}
+
+TEST(integration_test, runs_a_sectioned_payload_read_from_a_pipe) {
+  // laid out the way Protocol.frame does: sources, library, options, input
+  msgpack::sbuffer input, sources, options;
+  msgpack::packer<msgpack::sbuffer> input_packer{input};
+  input_packer.pack_map(1);
+  input_packer.pack(symbol{"greeting"});
+  input_packer.pack(std::string{"hello"});
+  msgpack::packer<msgpack::sbuffer> sources_packer{sources};
+  sources_packer.pack_array(1);
+  sources_packer.pack_array(2);
+  sources_packer.pack(std::string{"greet"});
+  sources_packer.pack(std::string{"@output = @input[:greeting] + ' world'"});
+  msgpack::packer<msgpack::sbuffer> options_packer{options};
+  options_packer.pack_map(1);
+  options_packer.pack(symbol{"dedup_strings"});
+  options_packer.pack(true);
+
+  std::string payload{"\xc1" "ESS" "\x01\0\0\0", 8};
+  append_big_endian(payload, sources.size() + options.size() + input.size());
+  append_big_endian(payload, sources.size() + options.size()); // input
+  append_big_endian(payload, input.size());
+  append_big_endian(payload, 0); // sources
+  append_big_endian(payload, sources.size());
+  append_big_endian(payload, 0); // no library
+  append_big_endian(payload, 0);
+  append_big_endian(payload, sources.size()); // options
+  append_big_endian(payload, options.size());
+  payload.append(sources.data(), sources.size());
+  payload.append(options.data(), options.size());
+  payload.append(input.data(), input.size());
+
+  int in[2], out[2];
+  if (pipe(in) == -1 || pipe(out) == -1) {
+    perror("pipe");
+    FAIL();
+  }
+  ASSERT_EQ(static_cast<ssize_t>(payload.size()), write(in[1], payload.data(), payload.size()));
+  close(in[1]);
+
+  me_memory_pool *allocator = me_memory_pool_new(4 * MiB);
+  me_mruby_engine *engine = me_mruby_engine_new(allocator, 100000);
+  {
+    output_stream stream{out[1]};
+    out_packer packer{stream};
+    data_writer writer(packer);
+    timer t = timer([](const std::string, const int64_t) {});
+    script_runner runner(*engine, t);
+
+    script_data script;
+    auto prepared = false;
+    ASSERT_TRUE(script.read_start_from(in[0], true));
+    script.read_rest_from(in[0], true, [&]() {
+      prepared = true;
+      runner.prepare(script);
+    });
+    EXPECT_TRUE(prepared);
+    EXPECT_TRUE(script.dedup_strings());
+    EXPECT_TRUE(runner.run(script, writer));
+  }
+  close(in[0]);
+  close(out[1]);
+  me_mruby_engine_destroy(engine);
+  me_memory_pool_destroy(allocator);
+
+  msgpack::unpacker pac;
+  ssize_t r;
+  do {
+    pac.reserve_buffer(BUFSIZE);
+    r = read(out[0], pac.buffer(), BUFSIZE);
+    pac.buffer_consumed(r > 0 ? r : 0);
+  } while (r > 0);
+  close(out[0]);
+
+  msgpack::object_handle oh;
+  auto outputs = 0;
+  while (pac.next(oh)) {
+    auto message = oh.get().via.array;
+    auto type = message.ptr[0].via.ext;
+    if (std::string{type.data(), type.size} != "output") {
+      continue;
+    }
+    ++outputs;
+    for (auto &&element : message.ptr[1].via.map) {
+      if (strncmp("extracted", element.key.via.ext.data(), element.key.via.ext.size) == 0) {
+        EXPECT_EQ("hello world", element.val.as<std::string>());
+      }
+    }
+  }
+  EXPECT_EQ(1, outputs);
+}
@@ -0,0 +1,33 @@
+#include "memory_pool.hpp"
+#include "units.hpp"
+#include "gtest/gtest.h"
+#include <cstdint>
+#include <cstring>
+
+TEST(memory_pool_test, restore_brings_back_the_snapshotted_blocks) {
+  me_memory_pool *pool = me_memory_pool_new(1 * MiB);
+  auto kept = static_cast<std::uint8_t *>(me_memory_pool_malloc(pool, 1000));
+  std::memset(kept, 0xAA, 1000);
+  auto before = me_memory_pool_info(pool);
+  me_memory_pool_snapshot *snapshot = me_memory_pool_snapshot_new(pool);
+
+  std::memset(kept, 0xBB, 1000);
+  auto dropped = static_cast<std::uint8_t *>(me_memory_pool_malloc(pool, 100 * KiB));
+  std::memset(dropped, 0xCC, 100 * KiB);
+
+  EXPECT_EQ(pool, me_memory_pool_restore(pool, snapshot));
+  auto after = me_memory_pool_info(pool);
+  EXPECT_EQ(before.uordblks, after.uordblks);
+  EXPECT_EQ(before.fordblks, after.fordblks);
+  for (std::size_t i = 0; i < 1000; ++i) {
+    ASSERT_EQ(0xAA, kept[i]);
+  }
+  auto reused = static_cast<std::uint8_t *>(me_memory_pool_malloc(pool, 100 * KiB));
+  EXPECT_EQ(dropped, reused);
+  for (std::size_t i = 0; i < 100 * KiB; ++i) {
+    ASSERT_EQ(0, reused[i]);
+  }
+
+  me_memory_pool_snapshot_destroy(snapshot);
+  me_memory_pool_destroy(pool);
+}
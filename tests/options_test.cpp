@@ -197,3 +197,167 @@ TEST(options_test, parses_all_options) {
   EXPECT_EQ(uint64_t{100200}, opts.instruction_quota());
   EXPECT_EQ(size_t{1048576}, opts.memory_quota());
 }
+
+TEST(options_test, defaults_to_serving_a_single_request) {
+
+  options opts;
+  EXPECT_FALSE(opts.fork_server());
+}
+
+TEST(options_test, parses_fork_server_flag) {
+  int argc = 2;
+  char *argv[] = { (char *) "options_test", (char *) "-z" };
+
+  std::ostringstream os;
+
+  options opts;
+  opts.read_from(argc, argv, os);
+
+  EXPECT_TRUE(os.str().empty());
+  EXPECT_TRUE(opts.fork_server());
+}
+
+TEST(options_test, parses_worker_flag) {
+  int argc = 2;
+  char *argv[] = { (char *) "options_test", (char *) "-w" };
+
+  std::ostringstream os;
+
+  options opts;
+  EXPECT_FALSE(opts.worker());
+  opts.read_from(argc, argv, os);
+
+  EXPECT_TRUE(os.str().empty());
+  EXPECT_TRUE(opts.worker());
+}
+
+TEST(options_test, parses_memfds) {
+  int argc = 5;
+  char *argv[] = { (char *) "options_test", (char *) "-I", (char *) "3", (char *) "-O", (char *) "4" };
+
+  std::ostringstream os;
+
+  options opts;
+  EXPECT_EQ(-1, opts.input_fd());
+  EXPECT_EQ(-1, opts.output_fd());
+  opts.read_from(argc, argv, os);
+
+  EXPECT_TRUE(os.str().empty());
+  EXPECT_EQ(3, opts.input_fd());
+  EXPECT_EQ(4, opts.output_fd());
+}
+
+TEST(options_test, parses_time_quota) {
+  int argc = 3;
+  char *argv[] = { (char *) "options_test", (char *) "-t", (char *) "250" };
+
+  std::ostringstream os;
+
+  options opts;
+  EXPECT_EQ(uint64_t{0}, opts.time_quota());
+  opts.read_from(argc, argv, os);
+
+  EXPECT_TRUE(os.str().empty());
+  EXPECT_EQ(uint64_t{250}, opts.time_quota());
+}
+
+TEST(options_test, parses_profile_flag) {
+  int argc = 2;
+  char *argv[] = { (char *) "options_test", (char *) "-P" };
+
+  std::ostringstream os;
+
+  options opts;
+  EXPECT_FALSE(opts.profile());
+  opts.read_from(argc, argv, os);
+
+  EXPECT_TRUE(os.str().empty());
+  EXPECT_TRUE(opts.profile());
+}
+
+TEST(options_test, parses_gc_options) {
+  int argc = 7;
+  char *argv[] = {
+    (char *) "options_test", (char *) "-r", (char *) "150", (char *) "-s", (char *) "400",
+    (char *) "-G", (char *) "incremental" };
+
+  std::ostringstream os;
+
+  options opts;
+  EXPECT_EQ(0, opts.gc_interval_ratio());
+  EXPECT_EQ(0, opts.gc_step_ratio());
+  EXPECT_EQ(-1, opts.gc_generational());
+  opts.read_from(argc, argv, os);
+
+  EXPECT_TRUE(os.str().empty());
+  EXPECT_EQ(150, opts.gc_interval_ratio());
+  EXPECT_EQ(400, opts.gc_step_ratio());
+  EXPECT_EQ(0, opts.gc_generational());
+}
+
+TEST(options_test, keeps_default_gc_mode_with_invalid_mode) {
+  int argc = 3;
+  char *argv[] = { (char *) "options_test", (char *) "-G", (char *) "unicorn" };
+
+  std::ostringstream os;
+
+  options opts;
+  opts.read_from(argc, argv, os);
+
+  EXPECT_EQ("Could not parse GC mode (-G) from: unicorn (generational or incremental)\n", os.str());
+  EXPECT_EQ(-1, opts.gc_generational());
+}
+
+TEST(options_test, rejects_time_quota_and_profiling_for_the_worker) {
+  int argc = 4;
+  char *argv[] = { (char *) "options_test", (char *) "-w", (char *) "-t", (char *) "100" };
+
+  std::ostringstream os;
+
+  options opts;
+  EXPECT_TRUE(opts.valid());
+  opts.read_from(argc, argv, os);
+
+  EXPECT_FALSE(os.str().empty());
+  EXPECT_FALSE(opts.valid());
+
+  argc = 3;
+  char *profiled[] = { (char *) "options_test", (char *) "-w", (char *) "-P" };
+  options profiling;
+  profiling.read_from(argc, profiled, os);
+  EXPECT_FALSE(profiling.valid());
+}
+
+TEST(options_test, rejects_code_cache_sizes_a_pool_cant_have) {
+  int argc = 3;
+  char *argv[] = { (char *) "options_test", (char *) "-k", (char *) "1024" };
+
+  std::ostringstream os;
+
+  options opts;
+  opts.read_from(argc, argv, os);
+
+  EXPECT_TRUE(os.str().find("Code cache size (-k) must be between") != std::string::npos);
+  EXPECT_FALSE(opts.valid());
+  EXPECT_EQ(size_t{0}, opts.code_cache_size());
+
+  argc = 4;
+  char *sized[] = { (char *) "options_test", (char *) "-w", (char *) "-k", (char *) "1048576" };
+  options cached;
+  cached.read_from(argc, sized, os);
+  EXPECT_TRUE(cached.valid());
+  EXPECT_EQ(size_t{1048576}, cached.code_cache_size());
+}
+
+TEST(options_test, rejects_a_code_cache_outside_the_worker) {
+  int argc = 3;
+  char *argv[] = { (char *) "options_test", (char *) "-k", (char *) "1048576" };
+
+  std::ostringstream os;
+
+  options opts;
+  opts.read_from(argc, argv, os);
+
+  EXPECT_EQ("Code cache size (-k) only applies to the worker (-w), its pool coming on top of the memory quota (-m)\n", os.str());
+  EXPECT_FALSE(opts.valid());
+}
@@ -0,0 +1,141 @@
+#include "profiler.hpp"
+#include "script_runner.hpp"
+#include "gtest/gtest.h"
+#include <cstring>
+#include <string>
+
+static const int BUFSIZE = 64 * 1024;
+
+static const msgpack::object *find(const msgpack::object &map, const char *key) {
+  for (auto &&element : map.via.map) {
+    if (element.key.via.ext.size == strlen(key) && strncmp(key, element.key.via.ext.data(), element.key.via.ext.size) == 0) {
+      return &element.val;
+    }
+  }
+  return nullptr;
+}
+
+TEST(profiler_test, attributes_instructions_to_sources_and_methods) {
+  int fd[2];
+  if (pipe(fd) == -1) {
+    perror("pipe");
+    FAIL();
+  }
+
+  std::uint64_t total;
+  {
+    output_stream stream{fd[1]};
+    out_packer packer{stream};
+    data_writer writer(packer);
+    me_memory_pool *allocator = me_memory_pool_new(4 * MiB);
+    me_mruby_engine *engine = me_mruby_engine_new(allocator, 100000);
+    profiler profile(writer, 20);
+    me_mruby_engine_profile(engine, &profile);
+
+    std::vector<ruby_source> sources;
+    sources.push_back({"A", "@output = 1"});
+    sources.push_back({"B", "def spin(n) ; n.times { } ; end ; spin(100)"});
+    script_data script;
+    script.sources(sources);
+    timer t([](const std::string, const int64_t) {});
+    EXPECT_TRUE(script_runner(*engine, t).run(script, writer));
+    total = engine->instruction_total;
+    profile.emit();
+    profile.emit();
+    me_mruby_engine_destroy(engine);
+    me_memory_pool_destroy(allocator);
+  }
+  close(fd[1]);
+
+  msgpack::unpacker unpacker;
+  ssize_t r;
+  do {
+    unpacker.reserve_buffer(BUFSIZE);
+    r = read(fd[0], unpacker.buffer(), BUFSIZE);
+    unpacker.buffer_consumed(r > 0 ? r : 0);
+  } while (r > 0);
+  close(fd[0]);
+
+  msgpack::object_handle oh, profile;
+  int profiles = 0;
+  while (unpacker.next(oh)) {
+    auto type = oh.get().via.array.ptr[0].via.ext;
+    if (std::string{type.data(), type.size} == "profile") {
+      profile = std::move(oh);
+      ++profiles;
+    }
+  }
+  ASSERT_EQ(1, profiles);
+
+  auto &body = profile.get().via.array.ptr[1];
+  auto sources = find(body, "sources")->via.array;
+  ASSERT_EQ(std::uint32_t{2}, sources.size);
+  auto counted = find(*find(body, "setup"), "instructions")->as<std::uint64_t>();
+  for (auto &&source : sources) {
+    counted += find(source, "instructions")->as<std::uint64_t>();
+  }
+  EXPECT_EQ(total, counted);
+  EXPECT_GT(
+    find(sources.ptr[1], "instructions")->as<std::uint64_t>(),
+    find(sources.ptr[0], "instructions")->as<std::uint64_t>());
+
+  auto methods = find(body, "methods")->via.array;
+  ASSERT_GT(methods.size, std::uint32_t{0});
+  EXPECT_LE(methods.size, std::uint32_t{20});
+  auto top = find(methods.ptr[0], "instructions")->as<std::uint64_t>();
+  for (auto &&method : methods) {
+    EXPECT_GE(top, find(method, "instructions")->as<std::uint64_t>());
+  }
+
+  // the block spin passes to times
+  auto blocks = find(body, "blocks")->via.array;
+  ASSERT_GT(blocks.size, std::uint32_t{0});
+  EXPECT_EQ(nullptr, find(blocks.ptr[0], "method"));
+  EXPECT_EQ(std::uint64_t{1}, find(blocks.ptr[0], "source")->as<std::uint64_t>());
+}
+
+TEST(profiler_test, counts_an_irep_freed_apart_from_the_next_at_its_address) {
+  int fd[2];
+  if (pipe(fd) == -1) {
+    perror("pipe");
+    FAIL();
+  }
+
+  {
+    output_stream stream{fd[1]};
+    out_packer packer{stream};
+    data_writer writer(packer);
+    me_memory_pool *allocator = me_memory_pool_new(4 * MiB);
+    me_mruby_engine *engine = me_mruby_engine_new(allocator, 100000);
+    profiler profile(writer, 20);
+
+    std::uint64_t irep[4];
+    auto address = reinterpret_cast<const struct mrb_irep *>(irep);
+    profile.enter_source(0);
+    profile.count_instruction(engine->state, address);
+    profile.count_instruction(engine->state, address);
+    profile.count_free(irep);
+    profile.count_allocation(64); // no irep is running
+    profile.count_instruction(engine->state, address);
+    profile.emit();
+    me_mruby_engine_destroy(engine);
+    me_memory_pool_destroy(allocator);
+  }
+  close(fd[1]);
+
+  char output[BUFSIZE];
+  ssize_t r, in = 0;
+  while ((r = read(fd[0], output + in, (size_t) (BUFSIZE - in))) > 0) {
+    in += r;
+  }
+  close(fd[0]);
+
+  auto oh = msgpack::unpack(output, in);
+  auto &body = oh.get().via.array.ptr[1];
+  auto methods = find(body, "methods")->via.array;
+  ASSERT_EQ(std::uint32_t{2}, methods.size);
+  EXPECT_EQ(std::uint64_t{2}, find(methods.ptr[0], "instructions")->as<std::uint64_t>());
+  EXPECT_EQ(std::uint64_t{0}, find(methods.ptr[0], "bytes")->as<std::uint64_t>());
+  EXPECT_EQ(std::uint64_t{1}, find(methods.ptr[1], "instructions")->as<std::uint64_t>());
+  EXPECT_EQ(std::uint32_t{0}, find(body, "blocks")->via.array.size);
+}
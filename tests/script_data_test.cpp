@@ -6,6 +6,9 @@
 #include "data.hpp"
 #include "error.hpp"
 #include "script_data.hpp"
+#include <mruby/array.h>
+#include <mruby/hash.h>
+#include <mruby/string.h>
 
 TEST(script_data_test, fails_on_empty_data) {
   int fd[2];
@@ -297,6 +300,255 @@ TEST(script_data_test, parses_input) {
   me_memory_pool_destroy(allocator);
 }
 
+TEST(script_data_test, parses_nested_input) {
+  int fd[2];
+  if (pipe(fd) == -1) {
+    perror("pipe");
+    FAIL();
+  }
+
+  output_stream stream{fd[1]};
+  out_packer packer{stream};
+  packer.pack_map(2);
+  packer.pack(symbol{"input"});
+  packer.pack_map(2);
+  packer.pack(symbol{"list"});
+  packer.pack_array(3);
+  packer.pack(1);
+  packer.pack(-2);
+  packer.pack(std::string{"three"});
+  packer.pack(std::string{"half"});
+  packer.pack(0.5);
+  packer.pack(symbol{"sources"});
+  packer.pack_array(0);
+  close(fd[1]);
+
+  script_data script;
+  script.read_from(fd[0]);
+  close(fd[0]);
+
+  me_memory_pool *allocator = me_memory_pool_new(4 * MiB);
+  me_mruby_engine *engine = me_mruby_engine_new(allocator, 100000);
+
+  mrb_value value = script.input(*engine);
+  ASSERT_TRUE(mrb_type(value) == MRB_TT_HASH);
+  auto list = mrb_hash_get(engine->state, value, mrb_symbol_value(mrb_intern_lit(engine->state, "list")));
+  ASSERT_TRUE(mrb_type(list) == MRB_TT_ARRAY);
+  EXPECT_EQ(mrb_fixnum(mrb_ary_ref(engine->state, list, 0)), 1);
+  EXPECT_EQ(mrb_fixnum(mrb_ary_ref(engine->state, list, 1)), -2);
+  auto three = mrb_ary_ref(engine->state, list, 2);
+  EXPECT_EQ(std::string(RSTRING_PTR(three), RSTRING_LEN(three)), "three");
+  auto half = mrb_hash_get(engine->state, value, mrb_str_new_lit(engine->state, "half"));
+  EXPECT_EQ(mrb_float(half), 0.5);
+
+  me_mruby_engine_destroy(engine);
+  me_memory_pool_destroy(allocator);
+}
+
+TEST(script_data_test, decodes_symbol_tables) {
+  msgpack::sbuffer buffer;
+  msgpack::packer<msgpack::sbuffer> packer{buffer};
+  packer.pack_map(2);
+  packer.pack(symbol{"input"});
+  packer.pack_array(3);
+  packer.pack_ext(3, SYMBOL_DEFINITION_EXT_CODE);
+  packer.pack_ext_body("dog", 3);
+  packer.pack_ext(1, SYMBOL_REFERENCE_EXT_CODE);
+  packer.pack_ext_body("\0", 1);
+  packer.pack_ext(1, SYMBOL_REFERENCE_EXT_CODE);
+  packer.pack_ext_body("\1", 1);
+  packer.pack(symbol{"sources"});
+  packer.pack_array(0);
+
+  script_data script;
+  script.read_from(buffer.data(), buffer.size());
+
+  me_memory_pool *allocator = me_memory_pool_new(4 * MiB);
+  me_mruby_engine *engine = me_mruby_engine_new(allocator, 100000);
+
+  // the last one refers to a symbol that was never defined
+  status_code code = status_code::ok;
+  try {
+    script.input(*engine);
+  } catch (fatal_error e) {
+    code = e.get_err_code();
+  }
+  EXPECT_EQ(code, status_code::bad_symbol);
+
+  buffer.clear();
+  packer.pack_map(2);
+  packer.pack(symbol{"input"});
+  packer.pack_array(2);
+  packer.pack_ext(3, SYMBOL_DEFINITION_EXT_CODE);
+  packer.pack_ext_body("dog", 3);
+  packer.pack_ext(1, SYMBOL_REFERENCE_EXT_CODE);
+  packer.pack_ext_body("\0", 1);
+  packer.pack(symbol{"sources"});
+  packer.pack_array(0);
+  script.read_from(buffer.data(), buffer.size());
+
+  mrb_value value = script.input(*engine);
+  ASSERT_TRUE(mrb_type(value) == MRB_TT_ARRAY);
+  auto dog = mrb_intern_lit(engine->state, "dog");
+  EXPECT_EQ(mrb_symbol(mrb_ary_ref(engine->state, value, 0)), dog);
+  EXPECT_EQ(mrb_symbol(mrb_ary_ref(engine->state, value, 1)), dog);
+
+  me_mruby_engine_destroy(engine);
+  me_memory_pool_destroy(allocator);
+}
+
+TEST(script_data_test, shares_short_strings_when_deduplicating) {
+  msgpack::sbuffer buffer;
+  msgpack::packer<msgpack::sbuffer> packer{buffer};
+  packer.pack_map(3);
+  packer.pack(symbol{"input"});
+  packer.pack_array(3);
+  packer.pack(std::string{"USD"});
+  packer.pack(std::string{"USD"});
+  packer.pack(std::string(100, 'x'));
+  packer.pack(symbol{"dedup_strings"});
+  packer.pack(true);
+  packer.pack(symbol{"sources"});
+  packer.pack_array(0);
+
+  script_data script;
+  script.read_from(buffer.data(), buffer.size());
+  EXPECT_TRUE(script.dedup_strings());
+
+  me_memory_pool *allocator = me_memory_pool_new(4 * MiB);
+  me_mruby_engine *engine = me_mruby_engine_new(allocator, 100000);
+
+  mrb_value value = script.input(*engine);
+  ASSERT_TRUE(mrb_type(value) == MRB_TT_ARRAY);
+  auto first = mrb_ary_ref(engine->state, value, 0);
+  EXPECT_EQ(mrb_str_ptr(first), mrb_str_ptr(mrb_ary_ref(engine->state, value, 1)));
+  EXPECT_TRUE(MRB_FROZEN_P(mrb_str_ptr(first)));
+  EXPECT_FALSE(MRB_FROZEN_P(mrb_str_ptr(mrb_ary_ref(engine->state, value, 2))));
+  EXPECT_EQ(engine->deduplicated_bytes, 3);
+
+  me_mruby_engine_destroy(engine);
+  me_memory_pool_destroy(allocator);
+}
+
+TEST(script_data_test, reads_payloads_in_place) {
+  msgpack::sbuffer buffer;
+  msgpack::packer<msgpack::sbuffer> packer{buffer};
+  packer.pack_map(2);
+  packer.pack(symbol{"input"});
+  packer.pack(std::string{"in place"});
+  packer.pack(symbol{"sources"});
+  packer.pack_array(0);
+
+  script_data script;
+  script.read_from(buffer.data(), buffer.size());
+  EXPECT_EQ(script.size(), buffer.size());
+
+  me_memory_pool *allocator = me_memory_pool_new(4 * MiB);
+  me_mruby_engine *engine = me_mruby_engine_new(allocator, 100000);
+
+  mrb_value value = script.input(*engine);
+  ASSERT_TRUE(mrb_type(value) == MRB_TT_STRING);
+  EXPECT_EQ(std::string(RSTRING_PTR(value), RSTRING_LEN(value)), "in place");
+
+  me_mruby_engine_destroy(engine);
+  me_memory_pool_destroy(allocator);
+
+  status_code code = status_code::ok;
+  try {
+    script.read_from(buffer.data(), buffer.size() - 1);
+  } catch (fatal_error e) {
+    code = e.get_err_code();
+  }
+  EXPECT_EQ(code, status_code::bad_input);
+}
+
+TEST(script_data_test, reads_sectioned_payloads) {
+  msgpack::sbuffer input, sources, options;
+  msgpack::packer<msgpack::sbuffer>{input}.pack(std::string{"sectioned"});
+  msgpack::packer<msgpack::sbuffer>{sources}.pack_array(0);
+  msgpack::packer<msgpack::sbuffer> options_packer{options};
+  options_packer.pack_map(1);
+  options_packer.pack(symbol{"lazy_input"});
+  options_packer.pack(false);
+
+  // input, sources, no library, options
+  std::uint64_t table[] = {
+    0, input.size(),
+    input.size(), sources.size(),
+    0, 0,
+    input.size() + sources.size(), options.size(),
+  };
+  std::string payload{"\xc1" "ESS" "\x01\0\0\0", 8};
+  auto append = [&payload](std::uint64_t value) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      payload.push_back(static_cast<char>(value >> shift));
+    }
+  };
+  append(input.size() + sources.size() + options.size());
+  for (auto value : table) {
+    append(value);
+  }
+  payload.append(input.data(), input.size());
+  payload.append(sources.data(), sources.size());
+  payload.append(options.data(), options.size());
+
+  script_data script;
+  script.read_from(payload.data(), payload.size());
+  EXPECT_EQ(script.size(), payload.size());
+  EXPECT_TRUE(script.sources().empty());
+
+  me_memory_pool *allocator = me_memory_pool_new(4 * MiB);
+  me_mruby_engine *engine = me_mruby_engine_new(allocator, 100000);
+
+  mrb_value value = script.input(*engine);
+  ASSERT_TRUE(mrb_type(value) == MRB_TT_STRING);
+  EXPECT_EQ(std::string(RSTRING_PTR(value), RSTRING_LEN(value)), "sectioned");
+
+  me_mruby_engine_destroy(engine);
+  me_memory_pool_destroy(allocator);
+
+  // an input section longer than the value it holds
+  payload[16 + 15] = static_cast<char>(input.size() + 1);
+  status_code code = status_code::ok;
+  try {
+    script.read_from(payload.data(), payload.size());
+  } catch (fatal_error e) {
+    code = e.get_err_code();
+  }
+  EXPECT_EQ(code, status_code::bad_input);
+}
+
+TEST(script_data_test, decodes_lazy_input_on_use) {
+  msgpack::sbuffer buffer;
+  msgpack::packer<msgpack::sbuffer> packer{buffer};
+  packer.pack_map(3);
+  packer.pack(symbol{"lazy_input"});
+  packer.pack_true();
+  packer.pack(symbol{"input"});
+  packer.pack_map(1);
+  packer.pack(symbol{"list"});
+  packer.pack_array(2);
+  packer.pack(1);
+  packer.pack(2);
+  packer.pack(symbol{"sources"});
+  packer.pack_array(0);
+
+  script_data script;
+  script.read_from(buffer.data(), buffer.size());
+
+  me_memory_pool *allocator = me_memory_pool_new(4 * MiB);
+  me_mruby_engine *engine = me_mruby_engine_new(allocator, 100000);
+
+  mrb_value value = script.input(*engine);
+  EXPECT_TRUE(mrb_type(value) == MRB_TT_DATA);
+  auto list = mrb_funcall(engine->state, value, "[]", 1, mrb_symbol_value(mrb_intern_lit(engine->state, "list")));
+  auto second = mrb_funcall(engine->state, list, "[]", 1, mrb_fixnum_value(1));
+  EXPECT_EQ(mrb_fixnum(second), 2);
+
+  me_mruby_engine_destroy(engine);
+  me_memory_pool_destroy(allocator);
+}
+
 TEST(script_data_test, fails_when_input_too_deep) {
   int fd[2];
   if (pipe(fd) == -1) {
@@ -348,3 +600,193 @@ TEST(script_data_test, fails_when_input_too_deep) {
 
   EXPECT_EQ(code, status_code::structure_too_deep);
 }
+
+static void pack_framed(output_stream &stream, const std::string &source) {
+  msgpack::sbuffer buffer;
+  msgpack::packer<msgpack::sbuffer> packer{buffer};
+  packer.pack_map(2);
+  packer.pack(symbol{"input"});
+  packer.pack_nil();
+  packer.pack(symbol{"sources"});
+  packer.pack_array(1);
+  packer.pack_array(2);
+  packer.pack(std::string{"path"});
+  packer.pack(source);
+
+  out_packer out{stream};
+  out.pack(buffer.size());
+  stream.write(buffer.data(), buffer.size());
+}
+
+TEST(script_data_test, reads_framed_payloads_one_at_a_time) {
+  int fd[2];
+  if (pipe(fd) == -1) {
+    perror("pipe");
+    FAIL();
+  }
+
+  output_stream stream{fd[1]};
+  pack_framed(stream, "first");
+  pack_framed(stream, std::string(300, 'x'));
+  close(fd[1]);
+
+  script_data first;
+  EXPECT_TRUE(first.read_framed_from(fd[0]));
+  EXPECT_EQ("first", first.sources()[0].source);
+
+  script_data second;
+  EXPECT_TRUE(second.read_framed_from(fd[0]));
+  EXPECT_EQ(std::string(300, 'x'), second.sources()[0].source);
+
+  script_data none;
+  EXPECT_FALSE(none.read_framed_from(fd[0]));
+  close(fd[0]);
+}
+
+TEST(script_data_test, fails_on_truncated_frame) {
+  int fd[2];
+  if (pipe(fd) == -1) {
+    perror("pipe");
+    FAIL();
+  }
+
+  output_stream stream{fd[1]};
+  out_packer packer{stream};
+  packer.pack(std::uint32_t{1000});
+  packer.pack_map(0);
+  close(fd[1]);
+
+  script_data script;
+  status_code code = status_code::ok;
+  try {
+    script.read_framed_from(fd[0]);
+  } catch (fatal_error e) {
+    code = e.get_err_code();
+  }
+  close(fd[0]);
+  EXPECT_EQ(code, status_code::bad_input);
+}
+
+TEST(script_data_test, fails_on_oversized_frame) {
+  int fd[2];
+  if (pipe(fd) == -1) {
+    perror("pipe");
+    FAIL();
+  }
+
+  output_stream stream{fd[1]};
+  out_packer packer{stream};
+  packer.pack(std::uint64_t{UINT64_MAX});
+  packer.pack_map(0);
+  close(fd[1]);
+
+  script_data script;
+  status_code code = status_code::ok;
+  try {
+    script.read_framed_from(fd[0]);
+  } catch (fatal_error e) {
+    code = e.get_err_code();
+  }
+  close(fd[0]);
+  EXPECT_EQ(code, status_code::bad_input);
+}
+
+static std::string section_header(std::uint64_t body_size, const std::vector<std::uint64_t> &table) {
+  std::string header{"\xc1" "ESS" "\x01\0\0\0", 8};
+  auto append = [&header](std::uint64_t value) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      header.push_back(static_cast<char>(value >> shift));
+    }
+  };
+  append(body_size);
+  for (auto value : table) {
+    append(value);
+  }
+  return header;
+}
+
+TEST(script_data_test, reads_sources_before_an_input_that_comes_last) {
+  int fd[2];
+  if (pipe(fd) == -1) {
+    perror("pipe");
+    FAIL();
+  }
+
+  msgpack::sbuffer input, sources;
+  msgpack::packer<msgpack::sbuffer>{input}.pack(std::string{"late"});
+  msgpack::packer<msgpack::sbuffer> sources_packer{sources};
+  sources_packer.pack_array(1);
+  sources_packer.pack_array(2);
+  sources_packer.pack(std::string{"path"});
+  sources_packer.pack(std::string{"@output = @input"});
+
+  // input, sources, no library, no options
+  auto head = section_header(sources.size() + input.size(), {
+    sources.size(), input.size(),
+    0, sources.size(),
+    0, 0,
+    0, 0,
+  });
+  head.append(sources.data(), sources.size());
+  ASSERT_EQ(static_cast<ssize_t>(head.size()), write(fd[1], head.data(), head.size()));
+
+  script_data script;
+  auto called = false;
+  script.read_from(fd[0], true, [&]() {
+    called = true;
+    EXPECT_EQ("@output = @input", script.sources()[0].source);
+    EXPECT_EQ(static_cast<ssize_t>(input.size()), write(fd[1], input.data(), input.size()));
+    close(fd[1]);
+  });
+  close(fd[0]);
+  EXPECT_TRUE(called);
+
+  me_memory_pool *allocator = me_memory_pool_new(4 * MiB);
+  me_mruby_engine *engine = me_mruby_engine_new(allocator, 100000);
+
+  mrb_value value = script.input(*engine);
+  ASSERT_TRUE(mrb_type(value) == MRB_TT_STRING);
+  EXPECT_EQ(std::string(RSTRING_PTR(value), RSTRING_LEN(value)), "late");
+
+  me_mruby_engine_destroy(engine);
+  me_memory_pool_destroy(allocator);
+}
+
+static status_code read_sectioned_status(const std::string &head) {
+  int fd[2];
+  if (pipe(fd) == -1) {
+    perror("pipe");
+    return status_code::io_failure;
+  }
+  EXPECT_EQ(static_cast<ssize_t>(head.size()), write(fd[1], head.data(), head.size()));
+  close(fd[1]);
+
+  script_data script;
+  status_code code = status_code::ok;
+  try {
+    script.read_from(fd[0], true);
+  } catch (fatal_error e) {
+    code = e.get_err_code();
+  }
+  close(fd[0]);
+  return code;
+}
+
+TEST(script_data_test, fails_on_sections_out_of_bounds) {
+  // the offset and size wrap around to within the body
+  EXPECT_EQ(status_code::bad_input, read_sectioned_status(section_header(16, {
+    UINT64_MAX, 2,
+    0, 0,
+    0, 0,
+    0, 0,
+  })));
+}
+
+TEST(script_data_test, fails_on_oversized_sections_before_allocating) {
+  EXPECT_EQ(status_code::bad_input, read_sectioned_status(section_header(std::uint64_t{1} << 40, {
+    0, 0,
+    0, 0,
+    0, 0,
+    0, 0,
+  })));
+}
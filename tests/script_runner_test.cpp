@@ -2,6 +2,7 @@
 // Created by Alex Snaps on 2016-12-06.
 //
 
+#include "error.hpp"
 #include "script_runner.hpp"
 #include "gtest/gtest.h"
 
@@ -31,7 +32,7 @@ TEST(script_runner_test, defaults_to_counting_all_instructions) {
   runner.run(script, writer);
   close(fd[1]);
   auto instruction_total = engine->instruction_total;
-  auto instruction_count = engine->instruction_count;
+  auto instruction_count = engine->instruction_count();
   auto execution_time_us = engine->execution_time_us;
   me_mruby_engine_destroy(engine);
   me_memory_pool_destroy(allocator);
@@ -64,7 +65,7 @@ TEST(script_runner_test, can_bypass_deserialization_instructions) {
   runner.run(script, writer, 1);
   close(fd[1]);
   auto instruction_total = engine->instruction_total;
-  auto instruction_count = engine->instruction_count;
+  auto instruction_count = engine->instruction_count();
   auto execution_time_us = engine->execution_time_us;
   me_mruby_engine_destroy(engine);
   me_memory_pool_destroy(allocator);
@@ -97,7 +98,7 @@ TEST(script_runner_test, runs_all_scripts) {
   script.sources(sources);
   runner.run(script, writer);
   close(fd[1]);
-  EXPECT_EQ(engine->instruction_total, engine->instruction_count);
+  EXPECT_EQ(engine->instruction_total, engine->instruction_count());
   EXPECT_GT(engine->execution_time_us, std::int64_t{0});
   me_mruby_engine_destroy(engine);
   me_memory_pool_destroy(allocator);
@@ -143,3 +144,231 @@ TEST(script_runner_test, runs_all_scripts) {
     }
   }
 }
+
+TEST(script_runner_test, runs_precompiled_sources_like_plain_ones) {
+  int fd[2];
+  if (pipe(fd) == -1) {
+    perror("pipe");
+    FAIL();
+  }
+
+  output_stream stream{fd[1]};
+  out_packer packer{stream};
+  data_writer writer(packer);
+  timer t([](const std::string, const int64_t) {});
+  ruby_source plain{"A", "@output = [1, 2, 3].map { |i| i * 2 }"};
+
+  me_memory_pool *allocator = me_memory_pool_new(4 * MiB);
+  me_mruby_engine *engine = me_mruby_engine_new(allocator, 100000);
+  auto bytecode = engine->dump_instruction_sequence(engine->generate_code(plain));
+  std::vector<ruby_source> sources;
+  sources.push_back(plain);
+  script_data script;
+  script.sources(sources);
+  script_runner(*engine, t).run(script, writer);
+  auto plain_count = engine->instruction_count();
+  me_mruby_engine_destroy(engine);
+  me_memory_pool_destroy(allocator);
+
+  allocator = me_memory_pool_new(4 * MiB);
+  engine = me_mruby_engine_new(allocator, 100000);
+  sources.clear();
+  sources.push_back({"A", std::string{bytecode.begin(), bytecode.end()}, true});
+  script.sources(sources);
+  auto success = script_runner(*engine, t).run(script, writer);
+  auto compiled_count = engine->instruction_count();
+  me_mruby_engine_destroy(engine);
+  me_memory_pool_destroy(allocator);
+
+  close(fd[1]);
+  close(fd[0]);
+  EXPECT_TRUE(success);
+  EXPECT_GT(plain_count, std::uint64_t{0});
+  EXPECT_EQ(plain_count, compiled_count);
+}
+
+TEST(script_runner_test, runs_sources_once_per_batch_item) {
+  int in[2], out[2];
+  if (pipe(in) == -1 || pipe(out) == -1) {
+    perror("pipe");
+    FAIL();
+  }
+
+  output_stream in_stream{in[1]};
+  out_packer in_packer{in_stream};
+  in_packer.pack_map(2);
+  in_packer.pack(symbol{"inputs"});
+  in_packer.pack_array(3);
+  in_packer.pack_int32(1);
+  in_packer.pack_int32(20);
+  in_packer.pack_int32(300);
+  in_packer.pack(symbol{"sources"});
+  in_packer.pack_array(1);
+  in_packer.pack_array(2);
+  in_packer.pack(std::string{"A"});
+  in_packer.pack(std::string{"@output = (@output || 0) + @input * 2"});
+  close(in[1]);
+
+  script_data script;
+  script.read_from(in[0]);
+  close(in[0]);
+  ASSERT_TRUE(script.batch());
+
+  output_stream stream{out[1]};
+  out_packer packer{stream};
+  data_writer writer(packer);
+  me_memory_pool *allocator = me_memory_pool_new(4 * MiB);
+  me_mruby_engine *engine = me_mruby_engine_new(allocator, 100000);
+  timer t([](const std::string, const int64_t) {});
+  script_runner runner(*engine, t);
+  EXPECT_TRUE(runner.run(script, writer));
+  close(out[1]);
+  me_mruby_engine_destroy(engine);
+  me_memory_pool_destroy(allocator);
+
+  msgpack::unpacker unpacker;
+  ssize_t r;
+  do {
+    unpacker.reserve_buffer(BUFSIZE);
+    r = read(out[0], unpacker.buffer(), BUFSIZE);
+    unpacker.buffer_consumed(r > 0 ? r : 0);
+  } while (r > 0);
+  close(out[0]);
+
+  std::vector<std::string> types;
+  std::vector<std::int64_t> items, outputs;
+  msgpack::object_handle oh;
+  while (unpacker.next(oh)) {
+    auto message = oh.get().via.array;
+    auto type = std::string{message.ptr[0].via.ext.data(), message.ptr[0].via.ext.size};
+    types.push_back(type);
+    if (type == "item") {
+      items.push_back(message.ptr[1].as<std::int64_t>());
+    } else if (type == "output") {
+      for (auto &&element : message.ptr[1].via.map) {
+        if (strncmp("extracted", element.key.via.ext.data(), element.key.via.ext.size) == 0) {
+          outputs.push_back(element.val.as<std::int64_t>());
+        }
+      }
+    }
+  }
+
+  EXPECT_EQ((std::vector<std::string>{
+    "item", "output", "stat",
+    "item", "output", "stat",
+    "item", "output", "stat",
+  }), types);
+  EXPECT_EQ((std::vector<std::int64_t>{0, 1, 2}), items);
+  EXPECT_EQ((std::vector<std::int64_t>{2, 40, 600}), outputs);
+}
+
+TEST(script_runner_test, reaches_the_quota_on_the_exact_instruction) {
+  me_memory_pool *allocator = me_memory_pool_new(4 * MiB);
+  me_mruby_engine *engine = me_mruby_engine_new(allocator, 100000);
+  auto proc = engine->generate_code({"A", "a = 0 ; 10.times { a += 1 } ; @output = a"});
+
+  engine->limit_instructions(false);
+  engine->eval(proc);
+  EXPECT_EQ(std::uint64_t{0}, engine->instruction_count());
+  auto uncounted = engine->instruction_total;
+  engine->limit_instructions(true);
+  engine->eval(proc);
+  auto count = engine->instruction_count();
+  EXPECT_EQ(uncounted, count);
+  EXPECT_EQ(2 * count, engine->instruction_total);
+
+  engine->instruction_quota = count;
+  engine->reset_instruction_count();
+  engine->eval(proc);
+  EXPECT_EQ(count, engine->instruction_count());
+
+  engine->instruction_quota = count - 1;
+  engine->reset_instruction_count();
+  EXPECT_EXIT(
+    engine->eval(proc),
+    ::testing::ExitedWithCode(static_cast<int>(status_code::instruction_quota_reached)),
+    "");
+  me_mruby_engine_destroy(engine);
+  me_memory_pool_destroy(allocator);
+}
+
+TEST(script_runner_test, recovers_from_a_quota_once_the_pool_is_restored) {
+  me_memory_pool *allocator = me_memory_pool_new(4 * MiB);
+  me_mruby_engine *engine = me_mruby_engine_new(allocator, 100000);
+  me_memory_pool_snapshot *pristine = me_memory_pool_snapshot_new(allocator);
+
+  leave_by_throwing(true);
+  try {
+    engine->eval(engine->generate_code({"A", "loop {}"}));
+    ADD_FAILURE() << "ran forever";
+  } catch (fatal_error e) {
+    EXPECT_EQ(status_code::instruction_quota_reached, e.get_err_code());
+  }
+  leave_by_throwing(false);
+
+  allocator = me_memory_pool_restore(allocator, pristine);
+  engine->eval(engine->generate_code({"A", "@output = 1 + 1"}));
+  EXPECT_EQ(2, mrb_fixnum(engine->extract("@output")));
+
+  me_memory_pool_snapshot_destroy(pristine);
+  me_mruby_engine_destroy(engine);
+  me_memory_pool_destroy(allocator);
+}
+
+TEST(script_runner_test, emits_a_final_stat_once_out_of_time) {
+  int fd[2];
+  if (pipe(fd) == -1) {
+    perror("pipe");
+    FAIL();
+  }
+
+  auto run_forever = [&fd]() {
+    output_stream stream{fd[1]};
+    out_packer packer{stream};
+    data_writer writer(packer);
+    me_memory_pool *allocator = me_memory_pool_new(4 * MiB);
+    me_mruby_engine *engine = me_mruby_engine_new(allocator, UINT64_MAX);
+    me_mruby_engine_limit_time(engine, 50);
+    mruby_data_writer engine_writer(writer, *engine);
+    engine->eval(engine->generate_code({"A", "loop {}"}));
+  };
+  EXPECT_EXIT(
+    run_forever(),
+    ::testing::ExitedWithCode(static_cast<int>(status_code::time_quota_reached)),
+    "");
+  close(fd[1]);
+
+  char output[BUFSIZE];
+  ssize_t r, in = 0;
+  while ((r = read(fd[0], output + in, (size_t) (BUFSIZE - in))) > 0) {
+    if ((in += r) >= BUFSIZE) break;
+  }
+  close(fd[0]);
+
+  msgpack::object_handle oh = msgpack::unpack(output, in);
+  auto message = oh.get().via.array;
+  ASSERT_EQ(std::uint32_t{2}, message.size);
+  EXPECT_EQ("stat", (std::string{message.ptr[0].via.ext.data(), message.ptr[0].via.ext.size}));
+}
+
+TEST(script_runner_test, configures_and_counts_garbage_collection) {
+  me_memory_pool *allocator = me_memory_pool_new(16 * MiB);
+  me_gc_options gc{100, 400, 0};
+  me_mruby_engine *engine = me_mruby_engine_new(allocator, UINT64_MAX, &gc);
+  EXPECT_EQ(100, engine->state->gc.interval_ratio);
+  EXPECT_EQ(400, engine->state->gc.step_ratio);
+  EXPECT_FALSE(engine->state->gc.generational);
+
+  engine->eval(engine->generate_code({"A", "20000.times { |i| [i.to_s] }"}));
+#ifdef ME_WRAP_OBJ_ALLOC
+  EXPECT_GE(engine->peak_live_objects, engine->state->gc.live);
+  EXPECT_GT(engine->gc_cycles, std::uint64_t{0});
+  EXPECT_GT(engine->gc_time_ns, std::uint64_t{0});
+#endif
+
+  me_mruby_engine_reset_gc_stats(engine);
+  EXPECT_EQ(std::uint64_t{0}, engine->gc_cycles);
+  EXPECT_EQ(engine->state->gc.live, engine->peak_live_objects);
+  me_mruby_engine_destroy(engine);
+  me_memory_pool_destroy(allocator);
+}
@@ -0,0 +1,74 @@
+#ifdef ME_ENABLE_VMSTATS
+
+#include "script_runner.hpp"
+#include "gtest/gtest.h"
+#include <cstring>
+#include <string>
+
+static const int BUFSIZE = 64 * 1024;
+
+TEST(vmstats_test, tallies_opcodes_and_sends_per_run) {
+  int fd[2];
+  if (pipe(fd) == -1) {
+    perror("pipe");
+    FAIL();
+  }
+
+  std::uint64_t total;
+  {
+    output_stream stream{fd[1]};
+    out_packer packer{stream};
+    data_writer writer(packer);
+    me_memory_pool *allocator = me_memory_pool_new(4 * MiB);
+    me_mruby_engine *engine = me_mruby_engine_new(allocator, 100000);
+
+    std::vector<ruby_source> sources;
+    sources.push_back({"A", "def spin(n) ; n.times { } ; end ; spin(3) ; spin(4)"});
+    script_data script;
+    script.sources(sources);
+    timer t([](const std::string, const int64_t) {});
+    EXPECT_TRUE(script_runner(*engine, t).run(script, writer));
+    total = engine->instruction_total;
+    me_mruby_engine_destroy(engine);
+    me_memory_pool_destroy(allocator);
+  }
+  close(fd[1]);
+
+  msgpack::unpacker unpacker;
+  ssize_t r;
+  do {
+    unpacker.reserve_buffer(BUFSIZE);
+    r = read(fd[0], unpacker.buffer(), BUFSIZE);
+    unpacker.buffer_consumed(r > 0 ? r : 0);
+  } while (r > 0);
+  close(fd[0]);
+
+  msgpack::object_handle oh;
+  std::string last;
+  while (unpacker.next(oh)) {
+    auto type = oh.get().via.array.ptr[0].via.ext;
+    last = std::string{type.data(), type.size};
+    if (last != "vmstats") {
+      continue;
+    }
+
+    auto &body = oh.get().via.array.ptr[1].via.map;
+    std::uint64_t executed = 0;
+    std::uint64_t spins = 0;
+    for (auto &&element : body) {
+      auto key = std::string{element.key.via.ext.data(), element.key.via.ext.size};
+      for (auto &&entry : element.val.via.map) {
+        if (key == "opcodes") {
+          executed += entry.val.as<std::uint64_t>();
+        } else if (std::string{entry.key.via.ext.data(), entry.key.via.ext.size} == "spin") {
+          spins = entry.val.as<std::uint64_t>();
+        }
+      }
+    }
+    EXPECT_EQ(total, executed);
+    EXPECT_EQ(std::uint64_t{2}, spins);
+  }
+  EXPECT_EQ("vmstats", last);
+}
+
+#endif
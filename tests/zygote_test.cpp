@@ -0,0 +1,96 @@
+#include "zygote.hpp"
+#include "gtest/gtest.h"
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+
+static void send_request(int control_fd, int in_fd, int out_fd) {
+  char byte = 0;
+  struct iovec iov;
+  iov.iov_base = &byte;
+  iov.iov_len = sizeof(byte);
+
+  union {
+    struct cmsghdr header;
+    char buffer[CMSG_SPACE(2 * sizeof(int))];
+  } control;
+  std::memset(&control, 0, sizeof(control));
+
+  struct msghdr message;
+  std::memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.buffer;
+  message.msg_controllen = sizeof(control.buffer);
+
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(2 * sizeof(int));
+  int fds[2] = {in_fd, out_fd};
+  std::memcpy(CMSG_DATA(header), fds, sizeof(fds));
+  ASSERT_EQ(1, sendmsg(control_fd, &message, 0));
+}
+
+static void read_reply(int control_fd, std::int32_t &pid, std::int32_t &value) {
+  std::int32_t reply[2];
+  ASSERT_EQ(static_cast<ssize_t>(sizeof(reply)), read(control_fd, reply, sizeof(reply)));
+  pid = reply[0];
+  value = reply[1];
+}
+
+TEST(zygote_test, serves_requests_while_earlier_ones_run) {
+  int control[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, control) == -1) {
+    perror("socketpair");
+    FAIL();
+  }
+
+  pid_t server = fork();
+  if (server == 0) {
+    close(control[0]);
+    timer quiet([](const std::string, const int64_t) {});
+    fork_per_request(control[1], quiet);
+    // a request's child: exits with the byte its client writes
+    char byte = 0;
+    if (read(STDIN_FILENO, &byte, 1) != 1) {
+      _exit(100);
+    }
+    _exit(byte);
+  }
+  close(control[1]);
+
+  int first_in[2], first_out[2], second_in[2], second_out[2];
+  ASSERT_EQ(0, pipe(first_in));
+  ASSERT_EQ(0, pipe(first_out));
+  ASSERT_EQ(0, pipe(second_in));
+  ASSERT_EQ(0, pipe(second_out));
+  send_request(control[0], first_in[0], first_out[1]);
+  send_request(control[0], second_in[0], second_out[1]);
+
+  std::int32_t first, second, pid, value;
+  read_reply(control[0], first, value);
+  EXPECT_EQ(-1, value);
+  read_reply(control[0], second, value);
+  EXPECT_EQ(-1, value);
+  EXPECT_NE(first, second);
+
+  // the second request finishes while the first one is still waiting
+  ASSERT_EQ(1, write(second_in[1], "\x02", 1));
+  read_reply(control[0], pid, value);
+  EXPECT_EQ(second, pid);
+  EXPECT_EQ(2, value);
+
+  ASSERT_EQ(1, write(first_in[1], "\x01", 1));
+  read_reply(control[0], pid, value);
+  EXPECT_EQ(first, pid);
+  EXPECT_EQ(1, value);
+
+  close(control[0]);
+  int status;
+  ASSERT_EQ(server, waitpid(server, &status, 0));
+  EXPECT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(0, WEXITSTATUS(status));
+}